@@ -1,310 +1,3550 @@
 #include "archive.h"
 
-bool CAArchiveCreate(Path archive, Path rootdir)
+#pragma mark - Checksums
+
+// Headers and trailers always use CRC32; this is for everything else
+static UInt64 CAChecksum(UInt8 type, MemoryAddress data, Size size)
+{
+    switch (type)
+    {
+        case kCAChecksumCRC32C: return OSXCalculateCRC32C(data, size);
+        case kCAChecksumXXH64:  return OSXCalculateXXH64(data, size);
+        default:                return OSXCalculateChecksum(data, size);
+    }
+}
+
+// XXH64 can't be combined, so its checksums always have to be read off the data
+static bool CAChecksumCombinable(UInt8 type)
+{
+    return type != kCAChecksumXXH64;
+}
+
+// The checksum of A followed by B (see OSXCombineChecksums)
+static UInt64 CAChecksumCombine(UInt8 type, UInt64 first, UInt64 second, UInt64 secondSize)
+{
+    if (type == kCAChecksumCRC32C) return OSXCombineCRC32C((UInt32)first, (UInt32)second, secondSize);
+    return OSXCombineChecksums((UInt32)first, (UInt32)second, secondSize);
+}
+
+#pragma mark - Events
+
+// Without a block nothing is reported; `lock` is only used once shared
+typedef struct {
+    CAArchiveEventBlock block;
+    MemoryAddress userinfo;
+    CAArchiveEvent event;
+    bool shared;
+    pthread_mutex_t lock;
+} CAEventReporter;
+
+static void CAEventReporterStart(CAEventReporter *reporter, CAArchiveEventBlock block, MemoryAddress userinfo)
+{
+    memset(reporter, 0, sizeof(CAEventReporter));
+    reporter->block = block;
+    reporter->userinfo = userinfo;
+}
+
+// For reporting from several workers at once
+static void CAEventReporterShare(CAEventReporter *reporter, bool shared)
+{
+    if (!reporter->block || reporter->shared == shared) return;
+
+    if (shared) pthread_mutex_init(&reporter->lock, NULL);
+    else pthread_mutex_destroy(&reporter->lock);
+
+    reporter->shared = shared;
+}
+
+static void CAReportEvent(CAEventReporter *reporter, UInt8 type, String name, UInt64 size)
+{
+    if (!reporter->block) return;
+    if (reporter->shared) pthread_mutex_lock(&reporter->lock);
+
+    CAArchiveEvent *event = &reporter->event;
+    event->type = type;
+    event->name = name;
+    event->size = size;
+
+    if (type == kCAEventFinished || type == kCAEventFailed)
+    {
+        event->entriesDone++;
+        event->bytesDone += size;
+    }
+
+    reporter->block(event, reporter->userinfo);
+    if (reporter->shared) pthread_mutex_unlock(&reporter->lock);
+}
+
+#pragma mark - Chunk Hashes
+
+#define CAAlign8(x) (((x) + 7) & ~7ULL)
+
+typedef struct {
+    UInt8 *data;
+    UInt64 dataSize;
+    UInt32 chunkShift;
+    UInt8 checksumType;
+    UInt64 first;
+    UInt64 *hashes;
+    UInt8 *damaged;
+} CAChunkContext;
+
+static UInt64 CAChunkCount(UInt64 dataSize, UInt32 chunkShift)
+{
+    return (dataSize + ((1ULL << chunkShift) - 1)) >> chunkShift;
+}
+
+static UInt64 CAChunkNodeCount(UInt64 leaves)
+{
+    UInt64 nodes = 0;
+
+    while (leaves > 1)
+    {
+        nodes += leaves;
+        leaves = (leaves + 1) / 2;
+    }
+
+    return nodes + leaves;
+}
+
+// Nodes are stored little-endian and parents hash their children as stored
+static UInt64 CAChunkHashNodes(UInt8 checksumType, UInt64 *children, UInt64 count)
+{
+    return CAChecksum(checksumType, children, count * sizeof(UInt64));
+}
+
+// Hashes (or, if damaged is set, checks) chunk `first + iteration`
+static void CAChunkHashWorker(MemoryAddress context, Size iteration)
+{
+    CAChunkContext *ctx = context;
+    UInt64 chunk = ctx->first + iteration;
+    UInt64 start = chunk << ctx->chunkShift;
+    UInt64 size = 1ULL << ctx->chunkShift;
+    if (start + size > ctx->dataSize) size = ctx->dataSize - start;
+
+    UInt64 hash = CAChecksum(ctx->checksumType, ctx->data + start, size);
+
+    if (ctx->damaged) {
+        ctx->damaged[iteration] = (hash != CALittle64(ctx->hashes[chunk]));
+    } else {
+        ctx->hashes[chunk] = CALittle64(hash);
+    }
+}
+
+// Fills in every level above the leaves and returns the root
+static UInt64 CAChunkBuildTree(UInt8 checksumType, UInt64 *nodes, UInt64 leaves)
+{
+    if (!leaves) return 0;
+
+    while (leaves > 1)
+    {
+        UInt64 *parents = nodes + leaves;
+        UInt64 parentCount = (leaves + 1) / 2;
+
+        for (UInt64 i = 0; i < parentCount; i++)
+            parents[i] = CALittle64(CAChunkHashNodes(checksumType, nodes + (2 * i), ((2 * i) + 1 < leaves) ? 2 : 1));
+
+        nodes = parents;
+        leaves = parentCount;
+    }
+
+    return CALittle64(nodes[0]);
+}
+
+// Checks only the nodes on the paths from leaves [lo, hi] up to the root
+static bool CAChunkVerifyTree(UInt8 checksumType, UInt64 *nodes, UInt64 leaves, UInt64 lo, UInt64 hi, UInt64 root)
+{
+    if (!leaves) return !root;
+
+    while (leaves > 1)
+    {
+        UInt64 *parents = nodes + leaves;
+        UInt64 parentCount = (leaves + 1) / 2;
+        lo /= 2; hi /= 2;
+
+        for (UInt64 i = lo; i <= hi; i++)
+        {
+            UInt64 hash = CAChunkHashNodes(checksumType, nodes + (2 * i), ((2 * i) + 1 < leaves) ? 2 : 1);
+            if (hash != CALittle64(parents[i])) return false;
+        }
+
+        nodes = parents;
+        leaves = parentCount;
+    }
+
+    return CALittle64(nodes[0]) == root;
+}
+
+// The tree starts at the first 8 byte boundary after the data region
+static UInt64 CAChunkTreeOffset(UInt64 dataOffset, UInt64 dataSize)
+{
+    return CAAlign8(dataOffset + dataSize);
+}
+
+// `destination` is where the tree starts, which has to be 8 byte aligned.
+// Returns the trailer's checksum.
+static UInt32 CAArchiveWriteChunkHashes(MemoryAddress data, UInt64 dataSize, UInt32 chunkShift, UInt8 checksumType, MemoryAddress destination)
+{
+    UInt64 chunkCount = CAChunkCount(dataSize, chunkShift);
+    UInt64 *nodes = (UInt64 *)destination;
+
+    CAChunkContext context = {
+        .data = data,
+        .dataSize = dataSize,
+        .chunkShift = chunkShift,
+        .checksumType = checksumType,
+        .first = 0,
+        .hashes = nodes,
+        .damaged = NULL
+    };
+
+    OSXApplyConcurrently(chunkCount, &context, CAChunkHashWorker);
+
+    CAArchiveChunkTrailer trailer = {
+        .magic = kCAChunkMagic,
+        .chunkShift = CALittle32(chunkShift),
+        .dataSize = CALittle64(dataSize),
+        .chunkCount = CALittle64(chunkCount),
+        .root = CALittle64(CAChunkBuildTree(checksumType, nodes, chunkCount)),
+        .reserved = 0,
+        .checksum = 0
+    };
+
+    UInt32 checksum = OSXCalculateChecksum((UInt8 *)&trailer, kCAChunkTrailerSize - sizeof(UInt32));
+    trailer.checksum = CALittle32(checksum);
+    memcpy(nodes + CAChunkNodeCount(chunkCount), &trailer, kCAChunkTrailerSize);
+
+    return checksum;
+}
+
+#pragma mark - Varints
+
+static Size CAVarintSize(UInt64 value)
+{
+    Size size = 1;
+
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+static UInt8 *CAVarintWrite(UInt8 *out, UInt64 value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (UInt8)value | 0x80;
+        value >>= 7;
+    }
+
+    *out++ = (UInt8)value;
+    return out;
+}
+
+static bool CAVarintDecode(UInt8 *in, UInt8 *end, UInt64 *values, UInt64 count)
+{
+    UInt64 i = 0;
+
+    while (i < count)
+    {
+        // Runs of single byte values (directories, short links) go 8 at a time
+        if (count - i >= 8 && end - in >= 8)
+        {
+            UInt64 word; memcpy(&word, in, sizeof(UInt64));
+
+            if (!(word & 0x8080808080808080ULL))
+            {
+                for (UInt8 k = 0; k < 8; k++) values[i + k] = in[k];
+
+                in += 8; i += 8;
+                continue;
+            }
+        }
+
+        UInt64 value = 0;
+        UInt32 shift = 0;
+
+        do {
+            if (in >= end || shift > 63) return false;
+
+            value |= (UInt64)(*in & 0x7F) << shift;
+            shift += 7;
+        } while (*in++ & 0x80);
+
+        values[i++] = value;
+    }
+
+    return true;
+}
+
+#pragma mark - Table
+
+typedef struct {
+    MemoryAddress mapaddr;
+    Size mapsize;
+    UInt64 dataStart;
+    UInt64 dataSize;
+    UInt64 checksum;
+    Path path;
+} CAArchiveShardMap;
+
+typedef struct {
+    MemoryAddress mapaddr;
+    Size mapsize;
+    UInt8 version;
+    UInt8 checksumType;
+    UInt32 flags;
+    UInt64 count;
+    UInt64 stringOffset;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+    UInt64 checksum;
+    UInt32 trailerChecksum;     // Version 5
+    CAArchiveEntry *entries;    // Version 4
+    UInt8 *types;               // Version 5 columns
+    UInt64 *nameOffsets;
+    UInt64 *dataOffsets;
+    UInt64 *parents;            // Only with hierarchical names
+    UInt64 *checksums;          // Only with entry checksums
+    UInt64 *sizes;              // Decoded from the varint column
+    String path;                // Hierarchical paths are rebuilt here
+    Size pathCapacity;
+    UInt64 prefixIndex;         // The directory whose path is in `path`
+    Size prefixLength;
+    CAArchiveShardMap *shards;  // Only with kCAFlagSharded (and a full mapping)
+    UInt32 shardCount;
+} CAArchiveTable;
+
+static UInt8 CAArchiveVersion(MemoryAddress mapaddr)
+{
+    char magic[4] = kCAMagic;
+    char version4[3] = kCAVersion4;
+    char version5[3] = kCAVersion5;
+
+    if (memcmp(mapaddr, magic, 4)) return 0;
+    if (!memcmp(mapaddr + 4, version4, 3)) return 4;
+    if (!memcmp(mapaddr + 4, version5, 3)) return 5;
+
+    return 0;
+}
+
+static bool CAArchiveHeaderIsValid(MemoryAddress mapaddr, Size mapsize)
+{
+    UInt8 version = (mapsize >= kCAHeaderSize) ? CAArchiveVersion(mapaddr) : 0;
+
+    if (version == 4)
+    {
+        CAArchiveHeader *header = (CAArchiveHeader *)mapaddr;
+        return header->headerChecksum == OSXCalculateChecksum((UInt8 *)header, kCAHeaderSize - (2 * sizeof(UInt32)));
+    }
+
+    if (version == 5 && mapsize >= kCAHeader5Size)
+    {
+        CAArchiveHeader5 *header = (CAArchiveHeader5 *)mapaddr;
+        return CALittle32(header->headerChecksum) == OSXCalculateChecksum((UInt8 *)header, offsetof(CAArchiveHeader5, checksum));
+    }
+
+    return false;
+}
+
+// Copies the trailer out of the mapping, in host order, if it checks out
+// (and, for version 5, matches the header)
+static bool CAArchiveReadChunkTrailer(CAArchiveTable *table, CAArchiveChunkTrailer *trailer)
+{
+    MemoryAddress mapaddr = table->mapaddr;
+    Size mapsize = table->mapsize;
+
+    if (!(table->flags & kCAFlagChunkHashes) || mapsize < table->dataOffset + kCAChunkTrailerSize) return false;
+
+    memcpy(trailer, mapaddr + (mapsize - kCAChunkTrailerSize), kCAChunkTrailerSize);
+    char magic[4] = kCAChunkMagic;
+    if (memcmp(trailer->magic, magic, 4)) return false;
+
+    UInt32 check = OSXCalculateChecksum((UInt8 *)trailer, kCAChunkTrailerSize - sizeof(UInt32));
+    if (check != CALittle32(trailer->checksum)) return false;
+    if (table->version == 5 && check != table->trailerChecksum) return false;
+
+    trailer->chunkShift = CALittle32(trailer->chunkShift);
+    trailer->dataSize = CALittle64(trailer->dataSize);
+    trailer->chunkCount = CALittle64(trailer->chunkCount);
+    trailer->root = CALittle64(trailer->root);
+    trailer->checksum = check;
+
+    if (trailer->chunkShift < kCAChunkShiftMin || trailer->chunkShift > kCAChunkShiftMax) return false;
+    if (trailer->dataSize > mapsize || trailer->chunkCount != CAChunkCount(trailer->dataSize, trailer->chunkShift)) return false;
+
+    UInt64 treeSize = CAChunkNodeCount(trailer->chunkCount) * sizeof(UInt64);
+    return CAChunkTreeOffset(table->dataOffset, trailer->dataSize) + treeSize + kCAChunkTrailerSize == mapsize;
+}
+
+// Reads the header fields of a mapping which covers at least the header
+static bool CAArchiveTableLoadHeader(CAArchiveTable *table, MemoryAddress mapaddr, Size mapsize)
+{
+    memset(table, 0, sizeof(CAArchiveTable));
+    table->mapaddr = mapaddr;
+    table->mapsize = mapsize;
+
+    if (mapsize < kCAHeaderSize) return false;
+    table->version = CAArchiveVersion(mapaddr);
+
+    if (table->version == 4) {
+        CAArchiveHeader *header = (CAArchiveHeader *)mapaddr;
+
+        table->flags = header->flags;
+        table->stringOffset = header->stringOffset;
+        table->dataOffset = header->dataOffset;
+        table->checksum = header->checksum;
+
+        if (table->flags & kCAFlagSharded) return false;
+        if (table->stringOffset < kCAHeaderSize || table->dataOffset < table->stringOffset) return false;
+        table->count = (table->stringOffset - kCAHeaderSize) / kCAEntrySize;
+
+        // Version 4 doesn't record the size of its data region
+        if (mapsize > table->dataOffset)
+        {
+            CAArchiveChunkTrailer trailer;
+            bool chunked = CAArchiveReadChunkTrailer(table, &trailer);
+            table->dataSize = chunked ? trailer.dataSize : (mapsize - table->dataOffset);
+        }
+    } else if (table->version == 5) {
+        if (mapsize < kCAHeader5Size) return false;
+        CAArchiveHeader5 *header = (CAArchiveHeader5 *)mapaddr;
+
+        table->flags = CALittle32(header->flags);
+        table->count = CALittle64(header->entryCount);
+        table->stringOffset = CALittle64(header->stringOffset);
+        table->dataOffset = CALittle64(header->dataOffset);
+        table->dataSize = CALittle64(header->dataSize);
+        table->checksum = CALittle64(header->checksum);
+        table->trailerChecksum = CALittle32(header->trailerChecksum);
+
+        table->checksumType = header->checksumType;
+
+        if (table->checksumType >= kCAChecksumCount) return false;
+        if ((table->flags & kCAFlagSharded) && (table->flags & kCAFlagChunkHashes)) return false;
+        if (table->flags & kCAFlagHierarchicalNames && !table->count) return false;
+        if (table->stringOffset < kCAHeader5Size || table->dataOffset < table->stringOffset) return false;
+        // Every entry needs at least 18 bytes of TOC
+        if ((table->stringOffset - kCAHeader5Size) / 18 < table->count) return false;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the header and TOC of a mapping which covers at least the string table
+static bool CAArchiveTableLoad(CAArchiveTable *table, MemoryAddress mapaddr, Size mapsize)
+{
+    if (!CAArchiveTableLoadHeader(table, mapaddr, mapsize)) return false;
+    if (mapsize < table->dataOffset) return false;
+
+    if (table->version == 4)
+    {
+        table->entries = (CAArchiveEntry *)(mapaddr + kCAHeaderSize);
+        return true;
+    }
+
+    UInt64 offset = kCAHeader5Size;
+    table->types = mapaddr + offset;
+    offset += CAAlign8(table->count);
+    table->nameOffsets = (UInt64 *)(mapaddr + offset);
+    offset += table->count * sizeof(UInt64);
+    table->dataOffsets = (UInt64 *)(mapaddr + offset);
+    offset += table->count * sizeof(UInt64);
+
+    if (table->flags & kCAFlagHierarchicalNames)
+    {
+        table->parents = (UInt64 *)(mapaddr + offset);
+        offset += table->count * sizeof(UInt64);
+        if (offset > table->stringOffset) return false;
+
+        // Parents must come first and never go backwards, so walking up always ends at the root
+        for (UInt64 i = 1; i < table->count; i++)
+        {
+            UInt64 parent = CALittle64(table->parents[i]);
+            if (parent >= i || parent < CALittle64(table->parents[i - 1])) return false;
+            if (table->types[parent] != kEntryTypeDirectory) return false;
+        }
+
+        table->prefixIndex = UINT64_MAX;
+    }
+
+    if (table->flags & kCAFlagEntryChecksums)
+    {
+        table->checksums = (UInt64 *)(mapaddr + offset);
+        offset += table->count * sizeof(UInt64);
+    }
+
+    if (offset > table->stringOffset) return false;
+    table->sizes = malloc(table->count * sizeof(UInt64));
+
+    if (!CAVarintDecode(mapaddr + offset, mapaddr + table->stringOffset, table->sizes, table->count))
+    {
+        free(table->sizes);
+        table->sizes = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static void CAArchiveTableUnload(CAArchiveTable *table)
+{
+    free(table->sizes);
+    free(table->path);
+
+    table->sizes = NULL;
+    table->path = NULL;
+    table->pathCapacity = 0;
+}
+
+// Maps every shard of a sharded archive. The shard table has to describe the
+// data region piece by piece and every shard has to agree with its entry.
+static bool CAArchiveTableOpenShards(CAArchiveTable *table, Path archive)
+{
+    CAArchiveShardTable *shardTable = table->mapaddr + table->dataOffset;
+    Size tablesize = table->mapsize - table->dataOffset;
+    char magic[4] = kCAShardMagic;
+
+    if (tablesize < sizeof(CAArchiveShardTable) || memcmp(shardTable->magic, magic, 4)) return false;
+
+    UInt32 count = CALittle32(shardTable->shardCount);
+    if (!count || count > kCAShardsMax) return false;
+    if ((tablesize - sizeof(CAArchiveShardTable)) / sizeof(CAArchiveShard) < count) return false;
+
+    table->shards = calloc(count, sizeof(CAArchiveShardMap));
+    table->shardCount = count;
+    UInt64 expected = 0;
+
+    for (UInt32 i = 0; i < count; i++)
+    {
+        CAArchiveShardMap *shard = &table->shards[i];
+        shard->dataStart = CALittle64(shardTable->shards[i].dataStart);
+        shard->dataSize = CALittle64(shardTable->shards[i].dataSize);
+        shard->checksum = CALittle64(shardTable->shards[i].checksum);
+
+        if (shard->dataStart != expected || shard->dataSize > table->dataSize - expected) return false;
+        expected += shard->dataSize;
+
+        asprintf(&shard->path, "%s.%u", archive, i);
+        shard->mapaddr = OSXMapFileFully(shard->path, &shard->mapsize, false);
+        if (!shard->mapaddr) return false;
+
+        CAArchiveShardHeader *header = shard->mapaddr;
+        bool valid = shard->mapsize == kCAShardHeaderSize + shard->dataSize && !memcmp(header->magic, magic, 4);
+
+        valid = valid && CALittle32(header->index) == i;
+        valid = valid && CALittle64(header->dataStart) == shard->dataStart && CALittle64(header->dataSize) == shard->dataSize;
+        valid = valid && CALittle32(header->headerChecksum) == OSXCalculateChecksum((UInt8 *)header, offsetof(CAArchiveShardHeader, headerChecksum));
+
+        if (!valid)
+        {
+            fprintf(stderr, "Error: File at '%s' is not a shard of this archive\n", shard->path);
+            return false;
+        }
+    }
+
+    return expected == table->dataSize;
+}
+
+static void CAArchiveTableCloseShards(CAArchiveTable *table)
+{
+    for (UInt32 i = 0; i < table->shardCount; i++)
+    {
+        if (table->shards[i].mapaddr) OSXUnmapFile(table->shards[i].mapaddr, table->shards[i].mapsize);
+        free(table->shards[i].path);
+    }
+
+    free(table->shards);
+    table->shards = NULL;
+    table->shardCount = 0;
+}
+
+// Maps an archive, either completely or only up to the end of its string table
+static bool CAArchiveTableOpen(Path archive, CAArchiveTable *table, bool full)
+{
+    Size mapsize = -1;
+    MemoryAddress mapaddr;
+
+    if (full) {
+        mapaddr = OSXMapFileFully(archive, &mapsize, false);
+        if (!mapaddr) return false;
+    } else {
+        mapaddr = OSXMapFile(archive, kCAHeader5Size, 0, false);
+        if (!mapaddr) return false;
+
+        bool known = CAArchiveTableLoadHeader(table, mapaddr, kCAHeader5Size);
+        OSXUnmapFile(mapaddr, kCAHeader5Size);
+
+        if (!known)
+        {
+            fprintf(stderr, "Error: File at '%s' is not a valid archive\n", archive);
+            return false;
+        }
+
+        mapsize = table->dataOffset;
+        mapaddr = OSXMapFile(archive, mapsize, 0, false);
+        if (!mapaddr) return false;
+    }
+
+    if (!CAArchiveTableLoad(table, mapaddr, mapsize))
+    {
+        fprintf(stderr, "Error: File at '%s' is not a valid archive\n", archive);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    if (full && (table->flags & kCAFlagSharded) && !CAArchiveTableOpenShards(table, archive))
+    {
+        fprintf(stderr, "Error: The shards of archive '%s' are missing or damaged\n", archive);
+        CAArchiveTableCloseShards(table);
+        CAArchiveTableUnload(table);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    return true;
+}
+
+static void CAArchiveTableClose(CAArchiveTable *table)
+{
+    CAArchiveTableCloseShards(table);
+    CAArchiveTableUnload(table);
+    OSXUnmapFile(table->mapaddr, table->mapsize);
+}
+
+static String CAArchiveTableGetBasename(CAArchiveTable *table, UInt64 index, Size *length)
+{
+    Size stringsize = table->dataOffset - table->stringOffset;
+    UInt64 nameOffset = CALittle64(table->nameOffsets[index]);
+
+    if (nameOffset >= stringsize)
+    {
+        *length = 0;
+        return "";
+    }
+
+    String name = table->mapaddr + (table->stringOffset + nameOffset);
+    *length = strnlen(name, stringsize - nameOffset);
+    return name;
+}
+
+static void CAArchiveTableReservePath(CAArchiveTable *table, Size size)
+{
+    if (size <= table->pathCapacity) return;
+
+    while (table->pathCapacity < size)
+        table->pathCapacity = table->pathCapacity ? (table->pathCapacity * 2) : 256;
+
+    table->path = realloc(table->path, table->pathCapacity);
+}
+
+// Leaves the path of directory `index` (without a trailing '/') at the start of the path buffer.
+// Siblings are contiguous, so this only does real work once per directory when iterating.
+static void CAArchiveTableBuildPrefix(CAArchiveTable *table, UInt64 index)
+{
+    if (table->prefixIndex == index) return;
+    Size length = 0, basenameLength;
+
+    for (UInt64 i = index; i; i = CALittle64(table->parents[i]))
+    {
+        CAArchiveTableGetBasename(table, i, &basenameLength);
+        length += basenameLength + 1;
+    }
+
+    CAArchiveTableReservePath(table, length + 1);
+    Size position = length;
+
+    for (UInt64 i = index; i; i = CALittle64(table->parents[i]))
+    {
+        String basename = CAArchiveTableGetBasename(table, i, &basenameLength);
+        position -= basenameLength;
+        memcpy(table->path + position, basename, basenameLength);
+        table->path[--position] = '/';
+    }
+
+    table->path[length] = 0;
+    table->prefixIndex = index;
+    table->prefixLength = length;
+}
+
+static void CAArchiveTableGetEntry(CAArchiveTable *table, UInt64 index, CAArchiveEntryInfo *info)
+{
+    UInt64 nameOffset;
+
+    if (table->version == 4) {
+        CAArchiveEntry *entry = table->entries + index;
+
+        nameOffset = entry->nameOffset;
+        info->type = entry->type;
+        info->size = entry->size;
+        info->dataOffset = entry->dataOffset;
+    } else {
+        nameOffset = CALittle64(table->nameOffsets[index]);
+        info->type = table->types[index];
+        info->size = table->sizes[index];
+        info->dataOffset = CALittle64(table->dataOffsets[index]);
+    }
+
+    info->index = index;
+
+    if (table->parents)
+    {
+        if (!index)
+        {
+            info->name = "/";
+            info->nameLength = 1;
+            return;
+        }
+
+        Size basenameLength;
+        String basename = CAArchiveTableGetBasename(table, index, &basenameLength);
+        CAArchiveTableBuildPrefix(table, CALittle64(table->parents[index]));
+        CAArchiveTableReservePath(table, table->prefixLength + basenameLength + 2);
+
+        table->path[table->prefixLength] = '/';
+        memcpy(table->path + table->prefixLength + 1, basename, basenameLength);
+        table->path[table->prefixLength + basenameLength + 1] = 0;
+
+        info->name = table->path;
+        info->nameLength = table->prefixLength + basenameLength + 1;
+        return;
+    }
+
+    Size stringsize = table->dataOffset - table->stringOffset;
+    String strings = table->mapaddr + table->stringOffset;
+
+    if (nameOffset < stringsize) {
+        info->name = strings + nameOffset;
+        info->nameLength = strnlen(info->name, stringsize - nameOffset);
+    } else {
+        info->name = "";
+        info->nameLength = 0;
+    }
+}
+
+// Finds the run of entries whose parent lies in [first, last]. Only valid for hierarchical tables.
+static void CAArchiveTableChildRange(CAArchiveTable *table, UInt64 first, UInt64 last, UInt64 *start, UInt64 *end)
+{
+    UInt64 lo = 1, hi = table->count;
+
+    while (lo < hi)
+    {
+        UInt64 mid = lo + ((hi - lo) / 2);
+
+        if (CALittle64(table->parents[mid]) < first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *start = lo;
+    hi = table->count;
+
+    while (lo < hi)
+    {
+        UInt64 mid = lo + ((hi - lo) / 2);
+
+        if (CALittle64(table->parents[mid]) <= last) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *end = lo;
+}
+
+// Finds an entry by its full path. Hierarchical tables are searched one
+// component at a time, the others are scanned.
+static bool CAArchiveTableLookup(CAArchiveTable *table, String path, UInt64 *index)
+{
+    if (!table->parents)
+    {
+        Size length = strlen(path);
+
+        for (UInt64 i = 0; i < table->count; i++)
+        {
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(table, i, &info);
+
+            if (info.nameLength == length && !memcmp(info.name, path, length))
+            {
+                *index = i;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    UInt64 current = 0;
+
+    while (*path)
+    {
+        while (*path == '/') path++;
+        if (!*path) break;
+
+        Size componentLength = strcspn(path, "/");
+        if (table->types[current] != kEntryTypeDirectory) return false;
+
+        // Children of `current` are contiguous and sorted by basename
+        UInt64 first, last;
+        CAArchiveTableChildRange(table, current, current, &first, &last);
+        bool found = false;
+
+        while (first < last)
+        {
+            UInt64 mid = first + ((last - first) / 2);
+            Size basenameLength;
+            String basename = CAArchiveTableGetBasename(table, mid, &basenameLength);
+
+            int order = memcmp(basename, path, (basenameLength < componentLength) ? basenameLength : componentLength);
+            if (!order) order = (basenameLength > componentLength) - (basenameLength < componentLength);
+
+            if (!order)
+            {
+                current = mid;
+                found = true;
+                break;
+            }
+
+            if (order < 0) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+
+        if (!found) return false;
+        path += componentLength;
+    }
+
+    *index = current;
+    return true;
+}
+
+// Only valid for tables opened over the whole archive
+// The last shard starting at or before `dataOffset`
+static UInt32 CAArchiveTableFindShard(CAArchiveTable *table, UInt64 dataOffset)
+{
+    UInt32 lo = 0, hi = table->shardCount;
+
+    while (hi - lo > 1)
+    {
+        UInt32 mid = lo + ((hi - lo) / 2);
+
+        if (table->shards[mid].dataStart <= dataOffset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static MemoryAddress CAArchiveTableGetData(CAArchiveTable *table, CAArchiveEntryInfo *info)
+{
+    if (info->dataOffset > table->dataSize || info->size > table->dataSize - info->dataOffset) return NULL;
+
+    if (table->shards)
+    {
+        // An entry's data never spans two shards
+        CAArchiveShardMap *shard = &table->shards[CAArchiveTableFindShard(table, info->dataOffset)];
+        UInt64 offset = info->dataOffset - shard->dataStart;
+
+        if (offset > shard->dataSize || info->size > shard->dataSize - offset) return NULL;
+        return shard->mapaddr + (kCAShardHeaderSize + offset);
+    }
+
+    return table->mapaddr + (table->dataOffset + info->dataOffset);
+}
+
+#pragma mark - Writer
+
+typedef struct {
+    MemoryAddress mapaddr;
+    UInt8 version;
+    UInt8 checksumType;
+    UInt32 flags;
+    UInt32 chunkShift;
+    UInt64 count;
+    UInt64 stringOffset;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+    UInt64 varintOffset;
+    Size finalsize;
+    bool dataChecksumKnown;     // Then only the table is read to checksum the archive
+    UInt64 dataChecksum;        // Of the whole data region, for combinable checksums
+} CAArchiveWriter;
+
+// Works out where every region of the archive goes. For version 5 archives
+// `varintsize` must be the encoded size of every entry's size. With shards
+// the shard table is laid out in place of the data.
+static bool CAArchiveWriterLayout(CAArchiveWriter *writer, UInt8 version, UInt8 checksumType, UInt32 flags, UInt32 chunkShift, UInt32 shardCount, UInt64 count, UInt64 namesize, UInt64 varintsize, UInt64 datasize)
+{
+    memset(writer, 0, sizeof(CAArchiveWriter));
+    writer->version = version;
+    writer->checksumType = checksumType;
+    writer->flags = flags;
+    writer->count = count;
+    writer->dataSize = datasize;
+    writer->chunkShift = chunkShift;
+
+    if (chunkShift) writer->flags |= kCAFlagChunkHashes;
+
+    if (version == 4) {
+        writer->stringOffset = kCAHeaderSize + (kCAEntrySize * count);
+        writer->dataOffset = writer->stringOffset + namesize;
+
+        if (writer->dataOffset > UINT32_MAX)
+        {
+            fprintf(stderr, "Error: Archive table is too large for version 4. Use version 5\n");
+            return false;
+        }
+    } else {
+        UInt64 columns = 2 + !!(flags & kCAFlagHierarchicalNames) + !!(flags & kCAFlagEntryChecksums);
+        writer->varintOffset = kCAHeader5Size + CAAlign8(count) + (columns * sizeof(UInt64) * count);
+        writer->stringOffset = CAAlign8(writer->varintOffset + varintsize);
+        writer->dataOffset = writer->stringOffset + namesize;
+    }
+
+    writer->finalsize = writer->dataOffset + datasize;
+
+    if (shardCount)
+    {
+        writer->flags |= kCAFlagSharded;
+        writer->finalsize = writer->dataOffset + sizeof(CAArchiveShardTable) + (shardCount * sizeof(CAArchiveShard));
+    }
+
+    if (chunkShift)
+        writer->finalsize = CAAlign8(writer->finalsize) + (CAChunkNodeCount(CAChunkCount(datasize, chunkShift)) * sizeof(UInt64)) + kCAChunkTrailerSize;
+
+    return true;
+}
+
+// Entries must be put in index order (the size column is variable length).
+// `parent` is ignored unless the archive has hierarchical names.
+static void CAArchiveWriterPut(CAArchiveWriter *writer, UInt64 index, UInt64 nameOffset, UInt8 type, UInt64 dataOffset, UInt64 size, UInt64 parent)
+{
+    if (writer->version == 4) {
+        CAArchiveEntry entry = {
+            .nameOffset = (UInt32)nameOffset,
+            .type = type,
+            .dataOffset = dataOffset,
+            .size = size
+        };
+
+        memcpy(writer->mapaddr + (kCAHeaderSize + (index * kCAEntrySize)), &entry, kCAEntrySize);
+    } else {
+        UInt64 *nameOffsets = writer->mapaddr + (kCAHeader5Size + CAAlign8(writer->count));
+        UInt64 *dataOffsets = nameOffsets + writer->count;
+        UInt8 *types = writer->mapaddr + kCAHeader5Size;
+
+        types[index] = type;
+        nameOffsets[index] = CALittle64(nameOffset);
+        dataOffsets[index] = CALittle64(dataOffset);
+
+        if (writer->flags & kCAFlagHierarchicalNames)
+        {
+            UInt64 *parents = dataOffsets + writer->count;
+            parents[index] = CALittle64(parent);
+        }
+
+        UInt8 *varint = writer->mapaddr + writer->varintOffset;
+        writer->varintOffset = CAVarintWrite(varint, size) - (UInt8 *)writer->mapaddr;
+    }
+}
+
+// Everything from the end of the header to `dataEnd`
+static UInt64 CAArchiveWriterChecksum(CAArchiveWriter *writer, UInt64 headerSize, UInt64 dataEnd)
+{
+    if (!writer->dataChecksumKnown || (writer->flags & kCAFlagSharded))
+        return CAChecksum(writer->checksumType, writer->mapaddr + headerSize, dataEnd - headerSize);
+
+    UInt64 table = CAChecksum(writer->checksumType, writer->mapaddr + headerSize, writer->dataOffset - headerSize);
+    return CAChecksumCombine(writer->checksumType, table, writer->dataChecksum, writer->dataSize);
+}
+
+// Writes the chunk hashes (if any) and the header. The shard table (if any)
+// has to be in place already.
+static void CAArchiveWriterFinish(CAArchiveWriter *writer)
+{
+    UInt64 dataEnd = (writer->flags & kCAFlagSharded) ? writer->finalsize : (writer->dataOffset + writer->dataSize);
+
+    UInt32 trailerChecksum = 0;
+
+    if (writer->chunkShift)
+        trailerChecksum = CAArchiveWriteChunkHashes(writer->mapaddr + writer->dataOffset, writer->dataSize, writer->chunkShift, writer->checksumType, writer->mapaddr + CAAlign8(dataEnd));
+
+    if (writer->version == 4) {
+        // Padded, so zeroed first to keep the padding (which headerChecksum covers) the same every time
+        CAArchiveHeader header;
+        memset(&header, 0, sizeof(CAArchiveHeader));
+
+        char magic[4] = kCAMagic;
+        char version[3] = kCAVersion4;
+        memcpy(header.magic, magic, 4);
+        memcpy(header.version, version, 3);
+
+        header.flags = (UInt16)writer->flags;
+        header.stringOffset = (UInt32)writer->stringOffset;
+        header.dataOffset = writer->dataOffset;
+
+        header.checksum = (UInt32)CAArchiveWriterChecksum(writer, kCAHeaderSize, dataEnd);
+        header.headerChecksum = OSXCalculateChecksum((UInt8 *)&header, sizeof(CAArchiveHeader) - (2 * sizeof(UInt32)));
+        memcpy(writer->mapaddr, &header, sizeof(CAArchiveHeader));
+    } else {
+        CAArchiveHeader5 header = {
+            .magic = kCAMagic,
+            .version = kCAVersion5,
+            .checksumType = writer->checksumType,
+            .flags = CALittle32(writer->flags),
+            .trailerChecksum = CALittle32(trailerChecksum),
+            .entryCount = CALittle64(writer->count),
+            .stringOffset = CALittle64(writer->stringOffset),
+            .dataOffset = CALittle64(writer->dataOffset),
+            .dataSize = CALittle64(writer->dataSize),
+            .checksum = 0,
+            .headerChecksum = 0,
+            .reserved2 = 0
+        };
+
+        UInt64 checksum = CAArchiveWriterChecksum(writer, kCAHeader5Size, dataEnd);
+        header.checksum = CALittle64(checksum);
+        header.headerChecksum = CALittle32(OSXCalculateChecksum((UInt8 *)&header, offsetof(CAArchiveHeader5, checksum)));
+        memcpy(writer->mapaddr, &header, sizeof(CAArchiveHeader5));
+    }
+}
+
+// Only for archives with entry checksums, in any order
+static void CAArchiveWriterPutChecksum(CAArchiveWriter *writer, UInt64 index, UInt64 checksum)
+{
+    UInt64 *checksums = writer->mapaddr + (kCAHeader5Size + CAAlign8(writer->count) + (2 * sizeof(UInt64) * writer->count));
+    if (writer->flags & kCAFlagHierarchicalNames) checksums += writer->count;
+
+    checksums[index] = CALittle64(checksum);
+}
+
+// Copies an entry's data, as it is stored in the archive, to `destination`
+static bool CAArchiveWriterCopyData(FileListEntry *entry, MemoryAddress destination)
+{
+    switch (entry->type)
+    {
+        case kEntryTypeRegular: {
+            if (!OSXWriteFileTo(entry->path, destination))
+                return false;
+        } break;
+        case kEntryTypeDirectory: {
+            // No data to store...
+        } break;
+        case kEntryTypeSparse: {
+            // Entries are packed back to back, so the map is copied in rather than stored through
+            UInt8 *extents = destination + sizeof(CASparseHeader);
+
+            CASparseHeader sparse = {
+                .logicalSize = CALittle64(entry->logicalSize),
+                .extentCount = CALittle64(entry->extentCount)
+            };
+
+            memcpy(destination, &sparse, sizeof(CASparseHeader));
+
+            for (UInt64 i = 0; i < 2 * entry->extentCount; i++)
+            {
+                UInt64 value = CALittle64(entry->extents[i]);
+                memcpy(extents + (i * sizeof(UInt64)), &value, sizeof(UInt64));
+            }
+
+            if (!OSXWriteExtentsTo(entry->path, entry->extents, entry->extentCount, extents + (2 * entry->extentCount * sizeof(UInt64))))
+                return false;
+        } break;
+        case kEntryTypeSymlink: {
+            String link = OSXReadLink(entry->path, NULL);
+            if (!link) return false;
+
+            memcpy(destination, link, entry->size);
+            free(link);
+        } break;
+        default:
+            fprintf(stderr, "Error: Invalid entry type\n");
+            return false;
+    }
+
+    return true;
+}
+
+#pragma mark - Matching
+
+typedef struct {
+    String name;
+    UInt64 index;
+} CANameIndexEntry;
+
+typedef struct {
+    UInt64 key;
+    UInt64 index;
+} CAKeyIndexEntry;
+
+typedef struct {
+    UInt64 *keys;
+    UInt64 count;
+    UInt64 capacity;
+} CAKeyList;
+
+static int CACompareNameIndexEntries(const void *a, const void *b)
+{
+    return strcmp(((CANameIndexEntry *)a)->name, ((CANameIndexEntry *)b)->name);
+}
+
+static int CACompareKeyIndexEntries(const void *a, const void *b)
+{
+    const CAKeyIndexEntry *left = a, *right = b;
+
+    if (left->key != right->key) return (left->key < right->key) ? -1 : 1;
+    return (left->index > right->index) - (left->index < right->index);
+}
+
+static int CACompareKeys(const void *a, const void *b)
+{
+    UInt64 left = *(UInt64 *)a, right = *(UInt64 *)b;
+    return (left > right) - (left < right);
+}
+
+static void CAKeyListAdd(CAKeyList *list, UInt64 key)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? (list->capacity * 2) : 64;
+        list->keys = realloc(list->keys, list->capacity * sizeof(UInt64));
+    }
+
+    list->keys[list->count++] = key;
+}
+
+// Flat tables are range scanned through a copy of the TOC order sorted by name.
+// The names are zero-copy pointers into the string table.
+static CANameIndexEntry *CAArchiveTableSortNames(CAArchiveTable *table)
+{
+    CANameIndexEntry *sorted = malloc(table->count * sizeof(CANameIndexEntry));
+
+    for (UInt64 i = 0; i < table->count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(table, i, &info);
+
+        sorted[i].name = info.name;
+        sorted[i].index = i;
+    }
+
+    qsort(sorted, table->count, sizeof(CANameIndexEntry), CACompareNameIndexEntries);
+    return sorted;
+}
+
+static bool CAPatternMatches(String pattern, bool glob, String base, Size baseLength, String name)
+{
+    if (glob) return !fnmatch(pattern, name, FNM_PATHNAME);
+
+    // Prefixes only match whole components
+    return !strncmp(name, base, baseLength) && (!name[baseLength] || name[baseLength] == '/');
+}
+
+static void CAArchiveTableMatchFlat(CAArchiveTable *table, CANameIndexEntry *sorted, String pattern, bool glob, String base, Size baseLength, CAKeyList *keys)
+{
+    UInt64 lo = 0, hi = table->count;
+
+    while (lo < hi)
+    {
+        UInt64 mid = lo + ((hi - lo) / 2);
+
+        if (strncmp(sorted[mid].name, base, baseLength) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < table->count && !strncmp(sorted[lo].name, base, baseLength); lo++)
+        if (CAPatternMatches(pattern, glob, base, baseLength, sorted[lo].name)) CAKeyListAdd(keys, lo);
+}
+
+// A subtree of a breadth first table is one contiguous run of entries per level
+static void CAArchiveTableMatchTree(CAArchiveTable *table, String pattern, bool glob, String base, CAKeyList *keys)
+{
+    UInt64 first, last;
+    if (!CAArchiveTableLookup(table, base, &first)) return;
+    last = first + 1;
+
+    while (first < last)
+    {
+        for (UInt64 i = first; i < last; i++)
+        {
+            if (glob)
+            {
+                CAArchiveEntryInfo info;
+                CAArchiveTableGetEntry(table, i, &info);
+                if (fnmatch(pattern, info.name, FNM_PATHNAME)) continue;
+            }
+
+            CAKeyListAdd(keys, i);
+        }
+
+        CAArchiveTableChildRange(table, first, last - 1, &first, &last);
+    }
+}
+
+#pragma mark - Readahead
+
+// Keeps `distance` bytes of the archive in flight ahead of the entry being
+// extracted and drops everything behind it from the page cache again, so a
+// cold archive is read as one sequential stream instead of page faults.
+// Both sides move in steps of a quarter of the distance.
+typedef struct {
+    int fd;
+    MemoryAddress mapaddr;
+    Size mapsize;
+    UInt64 distance;
+    UInt64 advised;     // Everything below this has been read ahead
+    UInt64 dropped;     // Everything below this has been dropped
+    UInt64 pageMask;
+    OSXBatch *batch;    // Must be flushed before anything it writes from is dropped
+} CAReadahead;
+
+// `file` is mapped at `mapaddr` and its data starts at `start`
+static void CAReadaheadStart(CAReadahead *readahead, Path file, MemoryAddress mapaddr, Size mapsize, UInt64 start, UInt64 distance, OSXBatch *batch)
+{
+    readahead->fd = distance ? open(file, O_RDONLY) : -1;
+    readahead->mapaddr = mapaddr;
+    readahead->mapsize = mapsize;
+    readahead->distance = distance;
+    readahead->pageMask = (UInt64)sysconf(_SC_PAGESIZE) - 1;
+    readahead->advised = readahead->dropped = start & ~readahead->pageMask;
+    readahead->batch = batch;
+}
+
+static bool CAReadaheadAdvance(CAReadahead *readahead, UInt64 position)
+{
+    if (readahead->fd < 0 || position > readahead->mapsize) return true;
+
+    UInt64 step = (readahead->distance / 4) ? (readahead->distance / 4) : 1;
+    UInt64 ahead = readahead->mapsize - position;
+    if (ahead > readahead->distance) ahead = readahead->distance;
+
+    if (position + ahead >= readahead->advised + step || (position + ahead == readahead->mapsize && readahead->advised < readahead->mapsize))
+    {
+        UInt64 start = (readahead->advised > position) ? readahead->advised : position;
+        OSXAdviseWillNeed(readahead->fd, start, (position + ahead) - start);
+        readahead->advised = position + ahead;
+    }
+
+    UInt64 behind = position & ~readahead->pageMask;
+
+    if (behind >= readahead->dropped + step)
+    {
+        if (readahead->batch && !OSXBatchFlush(readahead->batch)) return false;
+
+        OSXAdviseDontNeed(readahead->fd, readahead->mapaddr, readahead->dropped, behind - readahead->dropped);
+        readahead->dropped = behind;
+    }
+
+    return true;
+}
+
+static void CAReadaheadFinish(CAReadahead *readahead)
+{
+    if (readahead->fd >= 0) close(readahead->fd);
+}
+
+#pragma mark - Directory Handles
+
+// Stands for the output directory in place of an entry index
+#define kCARootDirectory UINT64_MAX
+
+// Extraction works relative to open handles on the directories it has
+// created, so every entry is made with a single component lookup instead
+// of resolving its whole path again. Directories are only ever opened
+// through their parent's handle and never through a symlink.
+//
+// Handles are opened on first use and the oldest is closed once more than
+// `limit` are open; a closed one is simply reopened from its parent.
+typedef struct {
+    CAArchiveTable *table;
+    int root;
+    int *handles;                   // Per entry, -1 while closed
+    UInt64 *open;                   // Ring of the entries holding a handle, oldest first
+    UInt64 openHead;
+    UInt64 openCount;
+    UInt64 limit;
+    CANameIndexEntry *directories;  // Flat tables look parents up by name
+    UInt64 directoryCount;
+    OSXBatch *batch;                // Must be flushed before a handle it may use is closed
+    bool create;                    // Directories are made on first use, for partial extraction
+} CADirectoryHandles;
+
+static bool CADirectoryHandlesIsRoot(CAArchiveTable *table, UInt64 index, CAArchiveEntryInfo *info)
+{
+    if (table->parents) return !index;
+    return strspn(info->name, "/") == info->nameLength;
+}
+
+static bool CADirectoryHandlesCreate(CADirectoryHandles *handles, CAArchiveTable *table, Path outdir, OSXBatch *batch)
+{
+    if (!OSXCreateDirectoryAt(outdir)) return false;
+    int root = open(outdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (root < 0)
+    {
+        fprintf(stderr, "Error: Could not open directory at '%s'\n", outdir);
+        perror("open");
+        return false;
+    }
+
+    // Leave most of the descriptor table to everything else
+    struct rlimit files;
+    UInt64 limit = getrlimit(RLIMIT_NOFILE, &files) ? 64 : (UInt64)files.rlim_cur / 2;
+    if (limit > kCAOpenDirectoriesMax) limit = kCAOpenDirectoriesMax;
+    if (limit < 8) limit = 8;
+
+    handles->table = table;
+    handles->root = root;
+    handles->handles = malloc(table->count * sizeof(int));
+    handles->open = malloc(limit * sizeof(UInt64));
+    handles->openHead = handles->openCount = 0;
+    handles->limit = limit;
+    handles->directories = NULL;
+    handles->directoryCount = 0;
+    handles->batch = batch;
+    handles->create = false;
+
+    for (UInt64 i = 0; i < table->count; i++)
+        handles->handles[i] = -1;
+
+    if (!table->parents)
+    {
+        handles->directories = malloc(table->count * sizeof(CANameIndexEntry));
+
+        for (UInt64 i = 0; i < table->count; i++)
+        {
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(table, i, &info);
+            if (info.type != kEntryTypeDirectory || CADirectoryHandlesIsRoot(table, i, &info)) continue;
+
+            handles->directories[handles->directoryCount].name = info.name;
+            handles->directories[handles->directoryCount].index = i;
+            handles->directoryCount++;
+        }
+
+        qsort(handles->directories, handles->directoryCount, sizeof(CANameIndexEntry), CACompareNameIndexEntries);
+    }
+
+    return true;
+}
+
+static void CADirectoryHandlesDestroy(CADirectoryHandles *handles)
+{
+    for (UInt64 i = 0; i < handles->openCount; i++)
+        close(handles->handles[handles->open[(handles->openHead + i) % handles->limit]]);
+
+    close(handles->root);
+    free(handles->directories);
+    free(handles->open);
+    free(handles->handles);
+}
+
+// A flat table names the parent by the leading `length` bytes of its path
+static bool CADirectoryHandlesFind(CADirectoryHandles *handles, String name, Size length, UInt64 *index)
+{
+    UInt64 lo = 0, hi = handles->directoryCount;
+
+    while (lo < hi)
+    {
+        UInt64 mid = lo + ((hi - lo) / 2);
+        String candidate = handles->directories[mid].name;
+        int order = strncmp(candidate, name, length);
+        if (!order && candidate[length]) order = 1;
+
+        if (!order)
+        {
+            *index = handles->directories[mid].index;
+            return true;
+        }
+
+        if (order < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    return false;
+}
+
+// A single, real component. Anything else could climb out of the output directory.
+static bool CAIsSafeName(String name, Size length)
+{
+    bool safe = length && memchr(name, '/', length) == NULL;
+    if (safe && name[0] == '.') safe = !(length == 1 || (length == 2 && name[1] == '.'));
+
+    if (!safe) fprintf(stderr, "Error: Entry name '%.*s' is not allowed\n", (int)length, name);
+    return safe;
+}
+
+// Finds the directory an entry is created in and its name inside that directory
+static bool CADirectoryHandlesLocate(CADirectoryHandles *handles, UInt64 index, UInt64 *parent, String *basename)
+{
+    CAArchiveTable *table = handles->table;
+    Size length;
+
+    if (table->parents) {
+        // Only the columns are read here, as the caller may still be using the rebuilt path
+        UInt64 owner = CALittle64(table->parents[index]);
+        *basename = CAArchiveTableGetBasename(table, index, &length);
+
+        if (owner && table->types[owner] != kEntryTypeDirectory)
+        {
+            fprintf(stderr, "Error: Parent of entry '%s' is not a directory\n", *basename);
+            return false;
+        }
+
+        *parent = owner ? owner : kCARootDirectory;
+    } else {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(table, index, &info);
+
+        Size slash = info.nameLength;
+        while (slash && info.name[slash - 1] != '/') slash--;
+
+        *basename = info.name + slash;
+        length = info.nameLength - slash;
+
+        // Leading slashes belong to the output directory
+        if (slash) slash--;
+        while (slash && info.name[slash - 1] == '/') slash--;
+
+        if (!slash) {
+            *parent = kCARootDirectory;
+        } else if (!CADirectoryHandlesFind(handles, info.name, slash, parent)) {
+            fprintf(stderr, "Error: Entry '%s' has no parent directory in the archive\n", info.name);
+            return false;
+        }
+    }
+
+    return CAIsSafeName(*basename, length);
+}
+
+static int CADirectoryHandlesGet(CADirectoryHandles *handles, UInt64 index)
+{
+    if (index == kCARootDirectory) return handles->root;
+    if (handles->handles[index] >= 0) return handles->handles[index];
+
+    UInt64 parent;
+    String basename;
+    if (!CADirectoryHandlesLocate(handles, index, &parent, &basename)) return -1;
+
+    int directory = CADirectoryHandlesGet(handles, parent);
+    if (directory < 0) return -1;
+    if (handles->create && !OSXCreateDirectoryIn(directory, basename)) return -1;
+
+    int fd = OSXOpenDirectoryIn(directory, basename);
+    if (fd < 0) return -1;
+
+    if (handles->openCount == handles->limit)
+    {
+        if (handles->batch && !OSXBatchFlush(handles->batch))
+        {
+            close(fd);
+            return -1;
+        }
+
+        UInt64 oldest = handles->open[handles->openHead];
+        handles->openHead = (handles->openHead + 1) % handles->limit;
+        handles->openCount--;
+
+        close(handles->handles[oldest]);
+        handles->handles[oldest] = -1;
+    }
+
+    handles->open[(handles->openHead + handles->openCount) % handles->limit] = index;
+    handles->openCount++;
+
+    handles->handles[index] = fd;
+    return fd;
+}
+
+// Where entry `index` goes: an open directory and a name inside it
+static bool CADirectoryHandlesResolve(CADirectoryHandles *handles, UInt64 index, int *directory, String *basename)
+{
+    UInt64 parent;
+    if (!CADirectoryHandlesLocate(handles, index, &parent, basename)) return false;
+
+    *directory = CADirectoryHandlesGet(handles, parent);
+    return *directory >= 0;
+}
+
+#pragma mark - Shards
+
+typedef struct {
+    Path archive;
+    FileListEntry **entries;
+    UInt64 count;
+    UInt32 *assignment;
+    UInt64 *offsets;
+    UInt64 *reads;              // Entry indices in the order to copy them in
+    UInt64 *checksums;          // Entry checksums, if wanted
+    UInt8 checksumType;
+    CAArchiveShard *shards;
+    bool *failed;
+} CAShardContext;
+
+// Entries go to shards largest first, each to the shard with the least data
+// so far. Within a shard their data is laid out in table order, and the
+// shards take consecutive pieces of the data region. Returns every entry's
+// data offset.
+static UInt64 *CAArchivePlanShards(FileListEntry **entries, UInt64 count, UInt32 shardCount, UInt32 *assignment, CAArchiveShard *shards)
+{
+    CAKeyIndexEntry *bySize = malloc(count * sizeof(CAKeyIndexEntry));
+    UInt64 *offsets = malloc(count * sizeof(UInt64));
+    memset(shards, 0, shardCount * sizeof(CAArchiveShard));
+
+    for (UInt64 i = 0; i < count; i++)
+    {
+        bySize[i].key = entries[i]->size;
+        bySize[i].index = i;
+    }
+
+    qsort(bySize, count, sizeof(CAKeyIndexEntry), CACompareKeyIndexEntries);
+
+    for (UInt64 i = count; i > 0; i--)
+    {
+        UInt32 lightest = 0;
+
+        for (UInt32 s = 1; s < shardCount; s++)
+            if (shards[s].dataSize < shards[lightest].dataSize) lightest = s;
+
+        assignment[bySize[i - 1].index] = lightest;
+        shards[lightest].dataSize += bySize[i - 1].key;
+    }
+
+    for (UInt32 s = 1; s < shardCount; s++)
+        shards[s].dataStart = shards[s - 1].dataStart + shards[s - 1].dataSize;
+
+    // Reuse the checksums as cursors until the shards are written
+    for (UInt64 i = 0; i < count; i++)
+    {
+        CAArchiveShard *shard = &shards[assignment[i]];
+        offsets[i] = shard->dataStart + shard->checksum;
+        shard->checksum += entries[i]->size;
+    }
+
+    free(bySize);
+    return offsets;
+}
+
+static void CAShardWriteWorker(MemoryAddress context, Size index)
+{
+    CAShardContext *ctx = context;
+    CAArchiveShard *shard = &ctx->shards[index];
+    Size size = kCAShardHeaderSize + shard->dataSize;
+    Path path; asprintf(&path, "%s.%zu", ctx->archive, index);
+
+    ctx->failed[index] = true;
+
+    if (!OSXCreateFile(path) || !OSXZeroFileToSize(path, size))
+    {
+        OSXUnlinkItemAt(path);
+        free(path);
+        return;
+    }
+
+    MemoryAddress mapaddr = OSXMapFileFully(path, NULL, true);
+
+    if (!mapaddr)
+    {
+        OSXUnlinkItemAt(path);
+        free(path);
+        return;
+    }
+
+    UInt8 *data = mapaddr + kCAShardHeaderSize;
+    bool success = true;
+
+    for (UInt64 read = 0; read < ctx->count && success; read++)
+    {
+        UInt64 i = ctx->reads[read];
+        if (ctx->assignment[i] != index) continue;
+
+        UInt8 *destination = data + (ctx->offsets[i] - shard->dataStart);
+        success = CAArchiveWriterCopyData(ctx->entries[i], destination);
+
+        if (success && ctx->checksums) ctx->checksums[i] = CAChecksum(ctx->checksumType, destination, ctx->entries[i]->size);
+    }
+
+    if (success)
+    {
+        CAArchiveShardHeader header = {
+            .magic = kCAShardMagic,
+            .index = CALittle32((UInt32)index),
+            .dataStart = CALittle64(shard->dataStart),
+            .dataSize = CALittle64(shard->dataSize),
+            .reserved = 0,
+            .headerChecksum = 0
+        };
+
+        header.headerChecksum = CALittle32(OSXCalculateChecksum((UInt8 *)&header, offsetof(CAArchiveShardHeader, headerChecksum)));
+        memcpy(mapaddr, &header, kCAShardHeaderSize);
+
+        shard->checksum = CAChecksum(ctx->checksumType, data, shard->dataSize);
+    }
+
+    OSXUnmapFile(mapaddr, size);
+    if (!success) OSXUnlinkItemAt(path);
+
+    ctx->failed[index] = !success;
+    free(path);
+}
+
+// Writes every shard file at once (filling in `checksums`, if given) and
+// then the shard table to `destination`
+static bool CAArchiveWriteShards(Path archive, FileListEntry **entries, UInt64 count, UInt32 *assignment, UInt64 *offsets, UInt64 *reads, UInt64 *checksums, UInt8 checksumType, CAArchiveShard *shards, UInt32 shardCount, MemoryAddress destination)
+{
+    bool *failed = calloc(shardCount, sizeof(bool));
+
+    CAShardContext context = {
+        .archive = archive,
+        .entries = entries,
+        .count = count,
+        .assignment = assignment,
+        .offsets = offsets,
+        .reads = reads,
+        .checksums = checksums,
+        .checksumType = checksumType,
+        .shards = shards,
+        .failed = failed
+    };
+
+    OSXApplyConcurrently(shardCount, &context, CAShardWriteWorker);
+    bool success = true;
+
+    for (UInt32 s = 0; s < shardCount; s++)
+        if (failed[s]) success = false;
+
+    free(failed);
+
+    if (!success)
+    {
+        for (UInt32 s = 0; s < shardCount; s++)
+        {
+            Path path; asprintf(&path, "%s.%u", archive, s);
+            OSXUnlinkItemAt(path);
+            free(path);
+        }
+
+        return false;
+    }
+
+    CAArchiveShardTable *table = destination;
+    char magic[4] = kCAShardMagic;
+
+    memcpy(table->magic, magic, 4);
+    table->shardCount = CALittle32(shardCount);
+
+    for (UInt32 s = 0; s < shardCount; s++)
+    {
+        table->shards[s].dataStart = CALittle64(shards[s].dataStart);
+        table->shards[s].dataSize = CALittle64(shards[s].dataSize);
+        table->shards[s].checksum = CALittle64(shards[s].checksum);
+    }
+
+    return true;
+}
+
+#pragma mark - Archive Operations
+
+static Size CAPathDepth(String path)
+{
+    Size depth = 0;
+
+    for (; *path; path++)
+        if (*path == '/') depth++;
+
+    return depth;
+}
+
+// Breadth first, then component by component (so '/' sorts below everything)
+static int CACompareHierarchical(const void *a, const void *b)
+{
+    UInt8 *left = (UInt8 *)(*(FileListEntry **)a)->path;
+    UInt8 *right = (UInt8 *)(*(FileListEntry **)b)->path;
+
+    Size leftDepth = CAPathDepth((String)left);
+    Size rightDepth = CAPathDepth((String)right);
+    if (leftDepth != rightDepth) return (leftDepth < rightDepth) ? -1 : 1;
+
+    for (;; left++, right++)
+    {
+        UInt8 l = (*left == '/') ? 1 : *left;
+        UInt8 r = (*right == '/') ? 1 : *right;
+
+        if (l != r) return (l < r) ? -1 : 1;
+        if (!l) return 0;
+    }
+}
+
+// How an entry being archived is reported, relative to the root
+static String CAEntryDisplayName(FileListEntry *entry, Size nameshift)
+{
+    String name = entry->path + nameshift;
+    return *name ? name : "/";
+}
+
+static int CAComparePaths(const void *a, const void *b)
+{
+    return strcmp((*(FileListEntry **)a)->path, (*(FileListEntry **)b)->path);
+}
+
+static bool CAArchiveCheckOptions(UInt8 version, UInt32 chunkShift, bool hierarchical, UInt32 shardCount, bool entryChecksums, UInt8 checksumType)
+{
+    if (version != 4 && version != 5)
+    {
+        fprintf(stderr, "Error: Unknown archive version %d\n", version);
+        return false;
+    }
+
+    if ((hierarchical || entryChecksums) && version != 5)
+    {
+        fprintf(stderr, "Error: Hierarchical names and entry checksums need a version 5 archive\n");
+        return false;
+    }
+
+    if (checksumType >= kCAChecksumCount || (checksumType != kCAChecksumCRC32 && version != 5))
+    {
+        fprintf(stderr, "Error: Unknown checksum type %d (only version 5 archives can use anything but CRC32)\n", checksumType);
+        return false;
+    }
+
+    if (shardCount && (version != 5 || chunkShift || shardCount > kCAShardsMax))
+    {
+        fprintf(stderr, "Error: Shards need a version 5 archive without chunk hashes and at most %d shards\n", kCAShardsMax);
+        return false;
+    }
+
+    if (chunkShift && (chunkShift < kCAChunkShiftMin || chunkShift > kCAChunkShiftMax))
+    {
+        fprintf(stderr, "Error: Chunk size must be between 2^%d and 2^%d bytes\n", kCAChunkShiftMin, kCAChunkShiftMax);
+        return false;
+    }
+
+    return true;
+}
+
+// Finds the directory holding entries[index] in a hierarchically sorted
+// array. Parents are non-decreasing, so the search starts from the last
+// entry's parent.
+static bool CAFindParent(FileListEntry **entries, UInt64 index, UInt64 *parent)
+{
+    String basename = strrchr(entries[index]->path, '/');
+    Size dirlength = basename - entries[index]->path;
+
+    while (*parent < index && (entries[*parent]->type != kEntryTypeDirectory ||
+                               strlen(entries[*parent]->path) != dirlength ||
+                               strncmp(entries[*parent]->path, entries[index]->path, dirlength)))
+    {
+        (*parent)++;
+    }
+
+    if (*parent == index)
+    {
+        fprintf(stderr, "Error: No parent directory for '%s'\n", entries[index]->path);
+        return false;
+    }
+
+    return true;
+}
+
+bool CAArchiveCreate(Path archive, Path rootdir, CAArchiveOptions *options)
+{
+    FileListLinked *list = FileListLinkedCreate();
+    list->sparse = options && options->sparseFiles;
+
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, options ? options->events : NULL, options ? options->userinfo : NULL);
+
+    if (reporter.block)
+    {
+        list->scanned = ^void (Path path, MemoryAddress userinfo) {
+            CAReportEvent(userinfo, kCAEventScanned, path, 0);
+        };
+
+        list->userinfo = &reporter;
+    }
+
+    bool added = FileListLinkedAddDirectory(list, rootdir);
+    Size nameshift = strlen(rootdir);
+
+    if (!added)
+    {
+        FileListLinkedDestory(list);
+        return false;
+    }
+
+    list->data.namesize -= (nameshift * list->data.listsize);
+    list->data.namesize++;
+
+    UInt8 version = (options && options->version) ? options->version : 4;
+    UInt32 chunkShift = options ? options->chunkShift : 0;
+    bool hierarchical = options && options->hierarchicalNames;
+    UInt32 shardCount = (options && options->shards > 1) ? options->shards : 0;
+    bool entryChecksums = options && options->entryChecksums;
+    UInt8 checksumType = options ? options->checksumType : kCAChecksumCRC32;
+
+    if (!CAArchiveCheckOptions(version, chunkShift, hierarchical, shardCount, entryChecksums, checksumType))
+    {
+        FileListLinkedDestory(list);
+        return false;
+    }
+
+    FileListArray *order = FileListToArray(list);
+    UInt64 count = order->data.listsize;
+    UInt64 varintsize = 0;
+
+    reporter.event.entriesTotal = count;
+    reporter.event.bytesTotal = list->data.datasize;
+
+    #define CADestroyLists()                    \
+        do {                                    \
+            free(order->entries);               \
+            free(order);                        \
+            FileListLinkedDestory(list);        \
+        } while (0)
+
+    if (hierarchical)
+    {
+        qsort(order->entries, count, sizeof(FileListEntry *), CACompareHierarchical);
+
+        // Only basenames go in the string table
+        list->data.namesize = 0;
+
+        for (UInt64 i = 0; i < count; i++)
+        {
+            String basename = i ? strrchr(order->entries[i]->path, '/') + 1 : "";
+            list->data.namesize += strlen(basename) + 1;
+        }
+    } else {
+        qsort(order->entries, count, sizeof(FileListEntry *), CAComparePaths);
+    }
+
+    if (version == 5)
+    {
+        for (UInt64 i = 0; i < count; i++)
+            varintsize += CAVarintSize(order->entries[i]->size);
+    }
+
+    CAArchiveWriter writer;
+    UInt32 flags = (hierarchical ? kCAFlagHierarchicalNames : 0) | (entryChecksums ? kCAFlagEntryChecksums : 0);
+
+    if (!CAArchiveWriterLayout(&writer, version, checksumType, flags, chunkShift, shardCount, count, list->data.namesize, varintsize, list->data.datasize))
+    {
+        CADestroyLists();
+        return false;
+    }
+
+    Size finalsize = writer.finalsize;
+
+    if (!OSXCreateFile(archive) || !OSXZeroFileToSize(archive, finalsize))
+    {
+        CADestroyLists();
+        OSXUnlinkItemAt(archive);
+        return false;
+    }
+
+    MemoryAddress mapaddr = OSXMapFileFully(archive, NULL, true);
+
+    if (!mapaddr)
+    {
+        CADestroyLists();
+        OSXUnlinkItemAt(archive);
+        return false;
+    }
+
+    writer.mapaddr = mapaddr;
+    Offset stringOffset = 0;
+
+    // The data is laid out in name order like the table, so the archive
+    // doesn't depend on where the files sit on disk. Only the copying goes in
+    // read order (see FileListArraySort), once the whole table is written.
+    UInt32 *assignment = NULL;
+    UInt64 *offsets = NULL;
+    UInt64 *reads = malloc(count * sizeof(UInt64));
+    UInt64 *checksums = NULL;
+    CAArchiveShard *shards = NULL;
+
+    FileListArraySort(order, reads);
+
+    if (shardCount) {
+        assignment = malloc(count * sizeof(UInt32));
+        shards = malloc(shardCount * sizeof(CAArchiveShard));
+        offsets = CAArchivePlanShards(order->entries, count, shardCount, assignment, shards);
+        if (entryChecksums) checksums = malloc(count * sizeof(UInt64));
+    } else {
+        UInt64 dataOffset = 0;
+        offsets = malloc(count * sizeof(UInt64));
+
+        for (UInt64 index = 0; index < count; index++)
+        {
+            offsets[index] = dataOffset;
+            dataOffset += order->entries[index]->size;
+        }
+    }
+
+    #define CAFreeShardPlan()                   \
+        do {                                    \
+            free(assignment);                   \
+            free(offsets);                      \
+            free(reads);                        \
+            free(checksums);                    \
+            free(shards);                       \
+        } while (0)
+
+    #define CACleanupAndReturnFalse()           \
+        do {                                    \
+            CAFreeShardPlan();                  \
+            CADestroyLists();                   \
+            OSXUnmapFile(mapaddr, finalsize);   \
+            OSXUnlinkItemAt(archive);           \
+            return false;                       \
+        } while (0)
+    FileListEntry *entry = order->entries[0];
+    UInt64 parent = 0;
+
+    // Fix to make root directory be entered as '/' in the archive
+    if (!hierarchical && (entry->path + nameshift)[0] != '/')
+    {
+        free(entry->path);
+        asprintf(&entry->path, "%s/", rootdir);
+    }
+
+    for (UInt64 index = 0; index < count; index++)
+    {
+        entry = order->entries[index];
+        String entryName = entry->path + nameshift;
+
+        if (hierarchical && index)
+        {
+            if (!CAFindParent(order->entries, index, &parent))
+                CACleanupAndReturnFalse();
+
+            entryName = strrchr(entry->path, '/') + 1;
+        } else if (hierarchical) {
+            entryName = "";
+        }
+
+        Size entryNameSize = strlen(entryName) + 1;
+
+        CAArchiveWriterPut(&writer, index, stringOffset, entry->type, offsets[index], entry->size, parent);
+        memcpy(mapaddr + (writer.stringOffset + stringOffset), entryName, entryNameSize);
+
+        stringOffset += entryNameSize;
+    }
+
+    for (UInt64 read = 0; !shardCount && read < count; read++)
+    {
+        UInt64 index = reads[read];
+        entry = order->entries[index];
+
+        String displayName = CAEntryDisplayName(entry, nameshift);
+        MemoryAddress destination = mapaddr + (writer.dataOffset + offsets[index]);
+        CAReportEvent(&reporter, kCAEventStarted, displayName, entry->size);
+
+        if (!CAArchiveWriterCopyData(entry, destination))
+        {
+            CAReportEvent(&reporter, kCAEventFailed, displayName, entry->size);
+            CACleanupAndReturnFalse();
+        }
+
+        CAReportEvent(&reporter, kCAEventFinished, displayName, entry->size);
+
+        if (entryChecksums) CAArchiveWriterPutChecksum(&writer, index, CAChecksum(checksumType, destination, entry->size));
+    }
+
+    if (shardCount && !CAArchiveWriteShards(archive, order->entries, count, assignment, offsets, reads, checksums, checksumType, shards, shardCount, mapaddr + writer.dataOffset))
+        CACleanupAndReturnFalse();
+
+    // Shard workers don't report, so sharded entries are only reported once all are written
+    for (UInt64 index = 0; shardCount && reporter.block && index < count; index++)
+    {
+        String displayName = CAEntryDisplayName(order->entries[index], nameshift);
+
+        CAReportEvent(&reporter, kCAEventStarted, displayName, order->entries[index]->size);
+        CAReportEvent(&reporter, kCAEventFinished, displayName, order->entries[index]->size);
+    }
+
+    for (UInt64 index = 0; checksums && index < count; index++)
+        CAArchiveWriterPutChecksum(&writer, index, checksums[index]);
+
+    CAFreeShardPlan();
+    CADestroyLists();
+    #undef CACleanupAndReturnFalse
+    #undef CAFreeShardPlan
+    #undef CADestroyLists
+
+    CAArchiveWriterFinish(&writer);
+    OSXUnmapFile(mapaddr, finalsize);
+    return true;
+}
+
+#define kCAMergeSynthesized UINT32_MAX
+
+// An input archive. With a file descriptor its data is copied by range, a
+// sharded archive's is copied entry by entry from the shard mappings.
+typedef struct {
+    CAArchiveTable table;
+    String prefix;
+    int fd;
+    bool dataChecksumKnown;     // Derived from the header, without reading the data
+    UInt64 dataChecksum;
+} CAMergeSource;
+
+// `entry` has to come first, so these can go wherever FileListEntry does
+typedef struct {
+    FileListEntry entry;        // The merged path
+    UInt32 input;               // kCAMergeSynthesized for the root and prefix directories
+    UInt64 index;               // In the input's table
+    UInt64 sourceOffset;        // In the input's data region
+    UInt64 dataOffset;          // In the merged data region
+} CAMergeEntry;
+
+// Turns "a//b/" into "/a/b" and "/" into "". Refuses '.' and '..'.
+static String CAMergeNormalizePrefix(String prefix)
+{
+    String normalized = malloc(strlen(prefix) + 2);
+    Size used = 0;
+
+    while (*prefix)
+    {
+        Size length = strcspn(prefix, "/");
+
+        if ((length == 1 && prefix[0] == '.') || (length == 2 && !strncmp(prefix, "..", 2)))
+        {
+            free(normalized);
+            return NULL;
+        }
+
+        if (length)
+        {
+            normalized[used++] = '/';
+            memcpy(normalized + used, prefix, length);
+            used += length;
+        }
+
+        prefix += length;
+        if (*prefix) prefix++;
+    }
+
+    normalized[used] = 0;
+    return normalized;
+}
+
+// Equal names end up next to each other in input order, and the order is
+// the one a hierarchical table is stored in
+static int CACompareMergeEntries(const void *a, const void *b)
+{
+    CAMergeEntry *left = *(CAMergeEntry **)a;
+    CAMergeEntry *right = *(CAMergeEntry **)b;
+
+    int order = CACompareHierarchical(a, b);
+    if (order) return order;
+
+    if (left->input != right->input) return (left->input < right->input) ? -1 : 1;
+    if (left->index != right->index) return (left->index < right->index) ? -1 : 1;
+    return 0;
+}
+
+// Data goes in input order and, within an input, in the order it is stored
+static int CACompareMergeData(const void *a, const void *b)
+{
+    CAMergeEntry *left = *(CAMergeEntry **)a;
+    CAMergeEntry *right = *(CAMergeEntry **)b;
+
+    if (left->input != right->input) return (left->input < right->input) ? -1 : 1;
+    if (left->sourceOffset != right->sourceOffset) return (left->sourceOffset < right->sourceOffset) ? -1 : 1;
+    return 0;
+}
+
+static void CAMergeAdd(CAMergeEntry *entries, UInt64 *count, Path path, UInt8 type, UInt64 size, UInt32 input, UInt64 index, UInt64 sourceOffset)
+{
+    CAMergeEntry *entry = &entries[(*count)++];
+
+    entry->entry.path = path;
+    entry->entry.type = type;
+    entry->entry.size = size;
+    entry->input = input;
+    entry->index = index;
+    entry->sourceOffset = sourceOffset;
+}
+
+// Opens an input and derives the checksum of its data region. The header
+// checksum runs over the table and then the data, so the data's checksum
+// falls out of it once the (much smaller) table is checksummed.
+static bool CAMergeOpenSource(CAMergeSource *source, CAArchiveMergeInput *input, UInt8 checksumType)
+{
+    source->prefix = CAMergeNormalizePrefix(input->prefix ? input->prefix : "");
+
+    if (!source->prefix)
+    {
+        fprintf(stderr, "Error: Invalid prefix '%s' for archive '%s'\n", input->prefix, input->archive);
+        return false;
+    }
+
+    if (!CAArchiveTableOpen(input->archive, &source->table, true))
+    {
+        source->table.mapaddr = NULL;
+        return false;
+    }
+
+    CAArchiveTable *table = &source->table;
+    if (table->shards) return true;
+
+    source->fd = open(input->archive, O_RDONLY | O_CLOEXEC);
+
+    if (source->fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open archive at '%s'\n", input->archive);
+        perror("open");
+        return false;
+    }
+
+    if (table->checksumType == checksumType && CAChecksumCombinable(checksumType))
+    {
+        UInt64 headerSize = (table->version == 4) ? kCAHeaderSize : kCAHeader5Size;
+        UInt64 head = CAChecksum(checksumType, table->mapaddr + headerSize, table->dataOffset - headerSize);
+
+        source->dataChecksum = CAChecksumCombine(checksumType, head, table->checksum, table->dataSize);
+        source->dataChecksumKnown = true;
+    }
+
+    return true;
+}
+
+static void CAMergeCloseSources(CAMergeSource *sources, Size count)
+{
+    for (Size i = 0; i < count; i++)
+    {
+        if (sources[i].table.mapaddr) CAArchiveTableClose(&sources[i].table);
+        if (sources[i].fd >= 0) close(sources[i].fd);
+        free(sources[i].prefix);
+    }
+
+    free(sources);
+}
+
+// Fills `entries` with everything but the inputs' roots, under their
+// prefixes, plus the directories of the prefixes themselves
+static bool CAMergeCollect(CAMergeSource *sources, Size count, CAMergeEntry *entries, UInt64 *used)
+{
+    for (UInt32 input = 0; input < count; input++)
+    {
+        CAArchiveTable *table = &sources[input].table;
+        String prefix = sources[input].prefix;
+
+        Size prefixLength = strlen(prefix);
+
+        for (Size i = 1; i <= prefixLength; i++)
+        {
+            if (prefix[i] == '/' || !prefix[i])
+                CAMergeAdd(entries, used, strndup(prefix, i), kEntryTypeDirectory, 0, kCAMergeSynthesized, 0, 0);
+        }
+
+        for (UInt64 index = 0; index < table->count; index++)
+        {
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(table, index, &info);
+
+            if (CADirectoryHandlesIsRoot(table, index, &info)) continue;
+
+            if (info.dataOffset > table->dataSize || info.size > table->dataSize - info.dataOffset)
+            {
+                fprintf(stderr, "Error: Entry '%s' points outside of its archive's data\n", info.name);
+                return false;
+            }
+
+            Size skip = strspn(info.name, "/");
+            Path path = NULL;
+            asprintf(&path, "%s/%.*s", prefix, (int)(info.nameLength - skip), info.name + skip);
+
+            CAMergeAdd(entries, used, path, info.type, info.size, input, index, info.dataOffset);
+        }
+    }
+
+    return true;
+}
+
+// Keeps one entry of every name. Directories of the same name are merged,
+// other duplicates are settled by the policy. Returns the number kept,
+// moved to the front of `sorted`, or UINT64_MAX on a conflict.
+static UInt64 CAMergeResolve(CAMergeEntry **sorted, UInt64 count, UInt8 policy)
+{
+    UInt64 kept = 0;
+
+    for (UInt64 start = 0, end; start < count; start = end)
+    {
+        UInt64 directories = 0;
+
+        for (end = start; end < count && !strcmp(sorted[start]->entry.path, sorted[end]->entry.path); end++)
+            if (sorted[end]->entry.type == kEntryTypeDirectory) directories++;
+
+        UInt64 choice = start;
+
+        if (directories && directories != end - start) {
+            fprintf(stderr, "Error: '%s' is a directory in one archive but not in another\n", sorted[start]->entry.path);
+            return UINT64_MAX;
+        } else if (!directories && end - start > 1) {
+            if (policy == kCAMergeFail)
+            {
+                fprintf(stderr, "Error: '%s' is in more than one archive\n", sorted[start]->entry.path);
+                return UINT64_MAX;
+            }
+
+            if (policy == kCAMergeKeepLast) choice = end - 1;
+        }
+
+        sorted[kept++] = sorted[choice];
+    }
+
+    return kept;
+}
+
+// Builds the merged table from the inputs' tables and copies their data
+// region by region, never looking at the files the archives were made of.
+bool CAArchiveMerge(Path archive, CAArchiveMergeInput *inputs, Size count, UInt8 policy, CAArchiveOptions *options)
+{
+    UInt8 version = (options && options->version) ? options->version : 4;
+    UInt32 chunkShift = options ? options->chunkShift : 0;
+    bool hierarchical = options && options->hierarchicalNames;
+    bool entryChecksums = options && options->entryChecksums;
+    UInt8 checksumType = options ? options->checksumType : kCAChecksumCRC32;
+
+    if (!CAArchiveCheckOptions(version, chunkShift, hierarchical, 0, entryChecksums, checksumType))
+        return false;
+
+    if (!count || policy > kCAMergeKeepLast || (options && options->shards > 1))
+    {
+        fprintf(stderr, "Error: Merging needs at least one archive, a known policy and no shards\n");
+        return false;
+    }
+
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, options ? options->events : NULL, options ? options->userinfo : NULL);
+
+    FileStats *outputStats = OSXFileExists(archive) ? OSXReadFileStats(archive, true) : NULL;
+    CAMergeSource *sources = calloc(count, sizeof(CAMergeSource));
+    UInt64 capacity = 1;
+
+    for (Size i = 0; i < count; i++)
+        sources[i].fd = -1;
+
+    for (Size i = 0; i < count; i++)
+    {
+        FileStats *stats = outputStats ? OSXReadFileStats(inputs[i].archive, true) : NULL;
+        bool same = stats && stats->st_dev == outputStats->st_dev && stats->st_ino == outputStats->st_ino;
+        free(stats);
+
+        if (same)
+        {
+            fprintf(stderr, "Error: Can't merge archive '%s' into itself\n", inputs[i].archive);
+            free(outputStats);
+            CAMergeCloseSources(sources, count);
+            return false;
+        }
+
+        if (!CAMergeOpenSource(&sources[i], &inputs[i], checksumType))
+        {
+            free(outputStats);
+            CAMergeCloseSources(sources, count);
+            return false;
+        }
+
+        capacity += sources[i].table.count + CAPathDepth(sources[i].prefix);
+    }
+
+    free(outputStats);
+
+    CAMergeEntry *entries = calloc(capacity, sizeof(CAMergeEntry));
+    CAMergeEntry **order = malloc(capacity * sizeof(CAMergeEntry *));
+    CAMergeEntry **data = malloc(capacity * sizeof(CAMergeEntry *));
+    UInt64 used = 0;
+
+    #define CADestroyEntries()                              \
+        do {                                                \
+            for (UInt64 i = 0; i < used; i++)               \
+                free(entries[i].entry.path);                \
+            free(entries);                                  \
+            free(order);                                    \
+            free(data);                                     \
+            CAMergeCloseSources(sources, count);            \
+        } while (0)
+
+    // The root goes first and the rest is sorted after it
+    CAMergeAdd(entries, &used, strdup(hierarchical ? "" : "/"), kEntryTypeDirectory, 0, kCAMergeSynthesized, 0, 0);
+
+    if (!CAMergeCollect(sources, count, entries, &used))
+    {
+        CADestroyEntries();
+        return false;
+    }
+
+    for (UInt64 i = 0; i < used; i++)
+        order[i] = &entries[i];
+
+    qsort(order + 1, used - 1, sizeof(CAMergeEntry *), CACompareMergeEntries);
+    UInt64 merged = CAMergeResolve(order + 1, used - 1, policy);
+
+    if (merged == UINT64_MAX)
+    {
+        CADestroyEntries();
+        return false;
+    }
+
+    merged++;
+
+    UInt64 namesize = 0, varintsize = 0, datasize = 0, dataCount = 0;
+
+    for (UInt64 i = 0; i < merged; i++)
+    {
+        String name = (hierarchical && i) ? strrchr(order[i]->entry.path, '/') + 1 : order[i]->entry.path;
+        namesize += strlen(name) + 1;
+
+        if (version == 5) varintsize += CAVarintSize(order[i]->entry.size);
+        if (order[i]->entry.size) data[dataCount++] = order[i];
+    }
+
+    qsort(data, dataCount, sizeof(CAMergeEntry *), CACompareMergeData);
+
+    for (UInt64 i = 0; i < dataCount; i++)
+    {
+        data[i]->dataOffset = datasize;
+        datasize += data[i]->entry.size;
+    }
+
+    reporter.event.entriesTotal = merged;
+    reporter.event.bytesTotal = datasize;
+
+    CAArchiveWriter writer;
+    UInt32 flags = (hierarchical ? kCAFlagHierarchicalNames : 0) | (entryChecksums ? kCAFlagEntryChecksums : 0);
+
+    if (!CAArchiveWriterLayout(&writer, version, checksumType, flags, chunkShift, 0, merged, namesize, varintsize, datasize))
+    {
+        CADestroyEntries();
+        return false;
+    }
+
+    Size finalsize = writer.finalsize;
+    int fd = open(archive, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not create file at '%s'\n", archive);
+        perror("open");
+        CADestroyEntries();
+        return false;
+    }
+
+    MemoryAddress mapaddr = NULL;
+
+    #define CACleanupAndReturnFalse()                       \
+        do {                                                \
+            if (mapaddr) OSXUnmapFile(mapaddr, finalsize);  \
+            close(fd);                                      \
+            CADestroyEntries();                             \
+            OSXUnlinkItemAt(archive);                       \
+            return false;                                   \
+        } while (0)
+
+    // The file starts out as one hole, so only what is copied or written is ever stored
+    if (ftruncate(fd, finalsize))
+    {
+        fprintf(stderr, "Error: Could not resize file at '%s'\n", archive);
+        perror("ftruncate");
+        CACleanupAndReturnFalse();
+    }
+
+    // Entries next to each other in an input are copied as one range. The
+    // checksum of each range comes from the input's header or its entry
+    // checksums when they use the same algorithm.
+    bool dataChecksumKnown = CAChecksumCombinable(checksumType);
+    UInt64 dataChecksum = 0;
+
+    for (UInt64 start = 0, end; start < dataCount; start = end)
+    {
+        CAMergeSource *source = &sources[data[start]->input];
+        CAArchiveTable *table = &source->table;
+        UInt64 sourceStart = data[start]->sourceOffset, sourceEnd = sourceStart;
+
+        for (end = start; end < dataCount && data[end]->input == data[start]->input && data[end]->sourceOffset == sourceEnd; end++)
+            sourceEnd += data[end]->entry.size;
+
+        if (source->fd >= 0) {
+            if (!OSXCopyFileRange(source->fd, table->dataOffset + sourceStart, fd, writer.dataOffset + data[start]->dataOffset, sourceEnd - sourceStart))
+                CACleanupAndReturnFalse();
+        } else {
+            for (UInt64 i = start; i < end; i++)
+            {
+                CAArchiveEntryInfo info = { .dataOffset = data[i]->sourceOffset, .size = data[i]->entry.size };
+                MemoryAddress from = CAArchiveTableGetData(table, &info);
+
+                if (!from || pwrite(fd, from, info.size, writer.dataOffset + data[i]->dataOffset) != (SSize)info.size)
+                {
+                    fprintf(stderr, "Error: Could not copy entry '%s'\n", data[i]->entry.path);
+                    CACleanupAndReturnFalse();
+                }
+            }
+        }
+
+        if (!dataChecksumKnown) continue;
+
+        if (!sourceStart && sourceEnd == table->dataSize && source->dataChecksumKnown) {
+            dataChecksum = CAChecksumCombine(checksumType, dataChecksum, source->dataChecksum, table->dataSize);
+        } else if (table->checksums && table->checksumType == checksumType) {
+            for (UInt64 i = start; i < end; i++)
+                dataChecksum = CAChecksumCombine(checksumType, dataChecksum, CALittle64(table->checksums[data[i]->index]), data[i]->entry.size);
+        } else {
+            dataChecksumKnown = false;
+        }
+    }
+
+    mapaddr = OSXMapFile(archive, finalsize, 0, true);
+    if (!mapaddr) CACleanupAndReturnFalse();
+
+    writer.mapaddr = mapaddr;
+    writer.dataChecksumKnown = dataChecksumKnown;
+    writer.dataChecksum = dataChecksum;
+
+    Offset stringOffset = 0;
+    UInt64 parent = 0;
+
+    for (UInt64 index = 0; index < merged; index++)
+    {
+        CAMergeEntry *entry = order[index];
+        String entryName = entry->entry.path;
+
+        if (hierarchical && index)
+        {
+            if (!CAFindParent((FileListEntry **)order, index, &parent))
+                CACleanupAndReturnFalse();
+
+            entryName = strrchr(entryName, '/') + 1;
+        }
+
+        Size entryNameSize = strlen(entryName) + 1;
+
+        CAArchiveWriterPut(&writer, index, stringOffset, entry->entry.type, entry->dataOffset, entry->entry.size, parent);
+        memcpy(mapaddr + (writer.stringOffset + stringOffset), entryName, entryNameSize);
+        stringOffset += entryNameSize;
+
+        if (entryChecksums)
+        {
+            CAArchiveTable *table = (entry->input == kCAMergeSynthesized) ? NULL : &sources[entry->input].table;
+            UInt64 checksum;
+
+            if (table && table->checksums && table->checksumType == checksumType) {
+                checksum = CALittle64(table->checksums[entry->index]);
+            } else {
+                checksum = CAChecksum(checksumType, mapaddr + (writer.dataOffset + entry->dataOffset), entry->entry.size);
+            }
+
+            CAArchiveWriterPutChecksum(&writer, index, checksum);
+        }
+
+        String displayName = CAEntryDisplayName(&entry->entry, 0);
+        CAReportEvent(&reporter, kCAEventStarted, displayName, entry->entry.size);
+        CAReportEvent(&reporter, kCAEventFinished, displayName, entry->entry.size);
+    }
+
+    CAArchiveWriterFinish(&writer);
+
+    #undef CACleanupAndReturnFalse
+    CADestroyEntries();
+    #undef CADestroyEntries
+
+    OSXUnmapFile(mapaddr, finalsize);
+
+    if (close(fd))
+    {
+        fprintf(stderr, "Error: Could not close file at '%s'\n", archive);
+        perror("close");
+        return false;
+    }
+
+    return true;
+}
+
+// Checks a sparse entry's extent map and returns it in host order
+static UInt64 *CAArchiveReadSparse(MemoryAddress data, UInt64 size, Size *logicalSize, UInt64 *count, MemoryAddress *extentData)
 {
-    FileListLinked *list = FileListLinkedCreate();
-    bool added = FileListLinkedAddDirectory(list, rootdir);
-    Size nameshift = strlen(rootdir);
+    if (size < sizeof(CASparseHeader)) return NULL;
 
-    if (!added)
+    // Not necessarily aligned, so everything is copied out
+    CASparseHeader sparse;
+    memcpy(&sparse, data, sizeof(CASparseHeader));
+
+    UInt64 extentCount = CALittle64(sparse.extentCount);
+    UInt64 stored = size - sizeof(CASparseHeader);
+    if (extentCount > stored / (2 * sizeof(UInt64))) return NULL;
+
+    UInt8 *mapped = data + sizeof(CASparseHeader);
+    UInt64 *extents = malloc((2 * extentCount + 1) * sizeof(UInt64));
+    UInt64 end = 0, total = 0;
+
+    *logicalSize = CALittle64(sparse.logicalSize);
+    stored -= 2 * sizeof(UInt64) * extentCount;
+
+    for (UInt64 i = 0; i < extentCount; i++)
     {
-        FileListLinkedDestory(list);
+        memcpy(extents + (2 * i), mapped + (2 * i * sizeof(UInt64)), 2 * sizeof(UInt64));
+        extents[(2 * i) + 0] = CALittle64(extents[(2 * i) + 0]);
+        extents[(2 * i) + 1] = CALittle64(extents[(2 * i) + 1]);
+
+        // Extents must be in order, must not overlap and must lie inside the file
+        bool valid = extents[2 * i] >= end && extents[(2 * i) + 1] <= *logicalSize - extents[2 * i] && *logicalSize >= extents[2 * i];
+        end = extents[2 * i] + extents[(2 * i) + 1];
+        total += extents[(2 * i) + 1];
+
+        if (!valid || total > stored)
+        {
+            free(extents);
+            return NULL;
+        }
+    }
+
+    if (total != stored)
+    {
+        free(extents);
+        return NULL;
+    }
+
+    *count = extentCount;
+    *extentData = mapped + (2 * extentCount * sizeof(UInt64));
+    return extents;
+}
+
+// `name` is looked up in `directory`, which may be AT_FDCWD for a whole path
+static bool CAArchiveWriteEntryAt(CAArchiveTable *table, CAArchiveEntryInfo *info, int directory, String name)
+{
+    MemoryAddress data = CAArchiveTableGetData(table, info);
+
+    if (!data)
+    {
+        fprintf(stderr, "Error: Data for entry '%s' lies outside of the archive\n", info->name);
+        return false;
+    }
+
+    switch (info->type)
+    {
+        case kEntryTypeRegular: {
+            if (!OSXWriteDataToFileIn(directory, name, data, info->size))
+                return false;
+        } break;
+        case kEntryTypeDirectory: {
+            if (!OSXCreateDirectoryIn(directory, name))
+                return false;
+        } break;
+        case kEntryTypeSymlink: {
+            if (!OSXCreateSymlinkIn(directory, data, name))
+                return false;
+        } break;
+        case kEntryTypeSparse: {
+            Size logicalSize;
+            UInt64 count;
+            MemoryAddress extentData;
+            UInt64 *extents = CAArchiveReadSparse(data, info->size, &logicalSize, &count, &extentData);
+
+            if (!extents)
+            {
+                fprintf(stderr, "Error: Sparse entry '%s' has an invalid extent map\n", info->name);
+                return false;
+            }
+
+            bool written = OSXWriteSparseDataToFileIn(directory, name, extentData, extents, count, logicalSize);
+            free(extents);
+
+            if (!written) return false;
+        } break;
+        default:
+            fprintf(stderr, "Error: Invalid Entry type 0x%02X", info->type);
+            return false;
+    }
+
+    return true;
+}
+
+static bool CAArchiveExtractEntryAt(CAArchiveTable *table, CAArchiveEntryInfo *info, int directory, String name, CAEventReporter *reporter)
+{
+    CAReportEvent(reporter, kCAEventStarted, info->name, info->size);
+    bool success = CAArchiveWriteEntryAt(table, info, directory, name);
+    CAReportEvent(reporter, success ? kCAEventFinished : kCAEventFailed, info->name, info->size);
+
+    return success;
+}
+
+// Extracts to a whole path. The entry is still made inside its parent like
+// any other, so the last component has to be a real name and an existing
+// symlink there is not followed.
+static bool CAArchiveExtractEntry(CAArchiveTable *table, CAArchiveEntryInfo *info, Path output, CAEventReporter *reporter)
+{
+    String slash = strrchr(output, '/');
+    String basename = slash ? (slash + 1) : output;
+    int directory = AT_FDCWD;
+
+    if (!CAIsSafeName(basename, strlen(basename)))
+    {
+        CAReportEvent(reporter, kCAEventFailed, info->name, info->size);
+        return false;
+    }
+
+    if (slash)
+    {
+        Path parent = (slash == output) ? strdup("/") : strndup(output, slash - output);
+        directory = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (directory < 0)
+        {
+            fprintf(stderr, "Error: Could not open directory at '%s'\n", parent);
+            perror("open");
+            free(parent);
+
+            CAReportEvent(reporter, kCAEventFailed, info->name, info->size);
+            return false;
+        }
+
+        free(parent);
+    }
+
+    bool success = CAArchiveExtractEntryAt(table, info, directory, basename, reporter);
+    if (directory != AT_FDCWD) close(directory);
+    return success;
+}
+
+bool CAArchiveExtractItem(Path archive, String item, Path output, CAArchiveExtractOptions *options)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, true)) return false;
+
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, options ? options->events : NULL, options ? options->userinfo : NULL);
+
+    UInt64 index;
+    bool success = true;
+
+    if (CAArchiveTableLookup(&table, item, &index))
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, index, &info);
+
+        reporter.event.entriesTotal = 1;
+        reporter.event.bytesTotal = info.size;
+        success = CAArchiveExtractEntry(&table, &info, output, &reporter);
+    }
+
+    CAArchiveTableClose(&table);
+    return success;
+}
+
+// Directories are created one level at a time, shallowest first, so every
+// parent exists before anything inside it is created. With a batch the
+// level has to be flushed before the next one can be queued.
+static bool CAArchiveExtractDirectories(CAArchiveTable *table, CADirectoryHandles *handles, OSXBatch *batch, CAEventReporter *reporter)
+{
+    CAKeyIndexEntry *directories = malloc(table->count * sizeof(CAKeyIndexEntry));
+    UInt64 directoryCount = 0;
+    bool success = true;
+
+    for (UInt64 i = 0; i < table->count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(table, i, &info);
+        if (info.type != kEntryTypeDirectory || CADirectoryHandlesIsRoot(table, i, &info)) continue;
+
+        directories[directoryCount].key = CAPathDepth(info.name);
+        directories[directoryCount].index = i;
+        directoryCount++;
+    }
+
+    qsort(directories, directoryCount, sizeof(CAKeyIndexEntry), CACompareKeyIndexEntries);
+    reporter->event.entriesTotal += directoryCount;
+
+    for (UInt64 d = 0; d < directoryCount && success; d++)
+    {
+        if (batch && d && directories[d].key != directories[d - 1].key && !OSXBatchFlush(batch))
+        {
+            success = false;
+            break;
+        }
+
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(table, directories[d].index, &info);
+
+        int directory;
+        String basename;
+
+        if (!CADirectoryHandlesResolve(handles, directories[d].index, &directory, &basename)) {
+            CAReportEvent(reporter, kCAEventFailed, info.name, 0);
+            success = false;
+        } else if (batch) {
+            CAReportEvent(reporter, kCAEventStarted, info.name, 0);
+            success = OSXBatchCreateDirectory(batch, directory, basename);
+            CAReportEvent(reporter, success ? kCAEventFinished : kCAEventFailed, info.name, 0);
+        } else {
+            success = CAArchiveExtractEntryAt(table, &info, directory, basename, reporter);
+        }
+    }
+
+    free(directories);
+    return success && (!batch || OSXBatchFlush(batch));
+}
+
+// Everything but directories, in the order their data is stored
+static UInt64 *CAArchiveTableDataOrder(CAArchiveTable *table, UInt64 *count)
+{
+    CAKeyIndexEntry *order = malloc(table->count * sizeof(CAKeyIndexEntry));
+    UInt64 *indexes = malloc(table->count * sizeof(UInt64));
+    bool sorted = true;
+    *count = 0;
+
+    for (UInt64 i = 0; i < table->count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(table, i, &info);
+        if (info.type == kEntryTypeDirectory) continue;
+
+        if (*count && info.dataOffset < order[*count - 1].key) sorted = false;
+
+        order[*count].key = info.dataOffset;
+        order[*count].index = i;
+        (*count)++;
+    }
+
+    // Archives written by CAArchiveCreate are already in data order
+    if (!sorted) qsort(order, *count, sizeof(CAKeyIndexEntry), CACompareKeyIndexEntries);
+
+    for (UInt64 i = 0; i < *count; i++)
+        indexes[i] = order[i].index;
+
+    free(order);
+    return indexes;
+}
+
+static bool CAArchiveExtractQueued(CAArchiveTable *table, CAArchiveEntryInfo *info, int directory, String name, OSXBatch *batch, CAEventReporter *reporter)
+{
+    MemoryAddress data = CAArchiveTableGetData(table, info);
+    bool regular = info->type == kEntryTypeRegular && info->size <= kOSXBatchMaxWrite;
+
+    if (!batch || !data || !(regular || info->type == kEntryTypeSymlink))
+        return CAArchiveExtractEntryAt(table, info, directory, name, reporter);
+
+    CAReportEvent(reporter, kCAEventStarted, info->name, info->size);
+
+    bool queued = regular ? OSXBatchWriteFile(batch, directory, name, data, info->size) :
+                            OSXBatchCreateSymlink(batch, directory, data, name);
+
+    CAReportEvent(reporter, queued ? kCAEventFinished : kCAEventFailed, info->name, info->size);
+    return queued;
+}
+
+typedef struct {
+    CAArchiveTable *table;
+    CAArchiveEntryInfo *infos;
+    String *outfiles;
+    UInt64 *starts;
+    UInt64 readahead;
+    CAEventReporter *reporter;
+    bool *failed;
+} CAShardExtractContext;
+
+static void CAShardExtractWorker(MemoryAddress context, Size index)
+{
+    CAShardExtractContext *ctx = context;
+    CAArchiveShardMap *shard = &ctx->table->shards[index];
+    bool success = true;
+
+    CAReadahead readahead;
+    CAReadaheadStart(&readahead, shard->path, shard->mapaddr, shard->mapsize, kCAShardHeaderSize, ctx->readahead, NULL);
+
+    for (UInt64 k = ctx->starts[index]; k < ctx->starts[index + 1] && success; k++)
+    {
+        CAReadaheadAdvance(&readahead, kCAShardHeaderSize + (ctx->infos[k].dataOffset - shard->dataStart));
+        success = CAArchiveExtractEntry(ctx->table, &ctx->infos[k], ctx->outfiles[k], ctx->reporter);
+    }
+
+    CAReadaheadFinish(&readahead);
+    ctx->failed[index] = !success;
+}
+
+// Every shard is extracted by its own worker. Hierarchical names are all
+// rebuilt in one buffer, so the paths are worked out up front.
+static bool CAArchiveExtractShards(CAArchiveTable *table, CADirectoryHandles *handles, Path outdir, UInt64 *order, UInt64 count, UInt64 distance, CAEventReporter *reporter)
+{
+    // Workers go by whole paths, so every name and parent is checked up front
+    for (UInt64 k = 0; k < count; k++)
+    {
+        UInt64 parent;
+        String basename;
+        if (!CADirectoryHandlesLocate(handles, order[k], &parent, &basename)) return false;
+    }
+
+    CAArchiveEntryInfo *infos = malloc(count * sizeof(CAArchiveEntryInfo));
+    String *outfiles = malloc(count * sizeof(String));
+    UInt64 *starts = calloc(table->shardCount + 1, sizeof(UInt64));
+    bool *failed = calloc(table->shardCount, sizeof(bool));
+    Size prefix = strlen(outdir);
+    UInt32 shard = 0;
+
+    // Data order keeps each shard's entries together
+    for (UInt64 k = 0; k < count; k++)
+    {
+        CAArchiveTableGetEntry(table, order[k], &infos[k]);
+        asprintf(&outfiles[k], "%s%s", outdir, infos[k].name);
+        infos[k].name = outfiles[k] + prefix;
+
+        UInt32 owner = CAArchiveTableFindShard(table, infos[k].dataOffset);
+        while (shard < owner) starts[++shard] = k;
+    }
+
+    while (shard < table->shardCount) starts[++shard] = count;
+
+    CAShardExtractContext context = {
+        .table = table,
+        .infos = infos,
+        .outfiles = outfiles,
+        .starts = starts,
+        .readahead = distance,
+        .reporter = reporter,
+        .failed = failed
+    };
+
+    CAEventReporterShare(reporter, true);
+    OSXApplyConcurrently(table->shardCount, &context, CAShardExtractWorker);
+    CAEventReporterShare(reporter, false);
+    bool success = true;
+
+    for (UInt32 s = 0; s < table->shardCount; s++)
+        if (failed[s]) success = false;
+
+    for (UInt64 k = 0; k < count; k++)
+        free(outfiles[k]);
+
+    free(failed);
+    free(starts);
+    free(outfiles);
+    free(infos);
+    return success;
+}
+
+bool CAArchiveExtractAll(Path archive, Path outdir, CAArchiveExtractOptions *options)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, true)) return false;
+
+    OSXBatch *batch = OSXBatchCreate(kOSXBatchDepth);
+    CADirectoryHandles handles;
+
+    if (!CADirectoryHandlesCreate(&handles, &table, outdir, batch))
+    {
+        if (batch) OSXBatchDestroy(batch);
+
+        CAArchiveTableClose(&table);
         return false;
     }
 
-    list->data.namesize -= (nameshift * list->data.listsize);
-    list->data.namesize++;
+    UInt64 count;
+    UInt64 *order = CAArchiveTableDataOrder(&table, &count);
+    UInt64 distance = options ? options->readahead : kCAReadaheadDefault;
+
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, options ? options->events : NULL, options ? options->userinfo : NULL);
+    reporter.event.entriesTotal = count;
+    reporter.event.bytesTotal = table.dataSize;
+
+    bool success = CAArchiveExtractDirectories(&table, &handles, batch, &reporter);
+
+    if (table.shards && success) {
+        success = CAArchiveExtractShards(&table, &handles, outdir, order, count, distance, &reporter);
+    } else if (success) {
+        CAReadahead readahead;
+        CAReadaheadStart(&readahead, archive, table.mapaddr, table.mapsize, table.dataOffset, distance, batch);
+
+        for (UInt64 k = 0; k < count && success; k++)
+        {
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(&table, order[k], &info);
+
+            if (!CAReadaheadAdvance(&readahead, table.dataOffset + info.dataOffset))
+            {
+                success = false;
+                break;
+            }
+
+            int directory;
+            String basename;
+
+            if (CADirectoryHandlesResolve(&handles, order[k], &directory, &basename)) {
+                success = CAArchiveExtractQueued(&table, &info, directory, basename, batch, &reporter);
+            } else {
+                CAReportEvent(&reporter, kCAEventFailed, info.name, info.size);
+                success = false;
+            }
+        }
+
+        CAReadaheadFinish(&readahead);
+    }
+
+    // Queued operations still refer to the directory handles
+    if (batch) success = OSXBatchDestroy(batch) && success;
+    CADirectoryHandlesDestroy(&handles);
 
-    UInt16 flags = 0;
-    // There aren't any flags...
-
-    UInt32 strOff = kCAHeaderSize + (kCAEntrySize * (UInt32)list->data.listsize);
-    UInt64 datOff = (UInt64)strOff + list->data.namesize;
-    Size finalsize = datOff + list->data.datasize;
-
-    CAArchiveHeader header = {
-        .magic = kCAMagic,
-        .version = kCAVersion4,
-        .flags = flags,
-        .stringOffset = strOff,
-        .dataOffset = datOff,
-        .checksum = 0,
-        .headerChecksum = 0
-    };
+    free(order);
+    CAArchiveTableClose(&table);
+    return success;
+}
 
-    if (!OSXCreateFile(archive) || !OSXZeroFileToSize(archive, finalsize))
+bool CAArchiveExtractMatching(Path archive, String *patterns, Size count, Path outdir, CAArchiveExtractOptions *options)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, true)) return false;
+
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, options ? options->events : NULL, options ? options->userinfo : NULL);
+
+    CANameIndexEntry *sorted = NULL;
+    CAKeyList keys = { .keys = NULL, .count = 0, .capacity = 0 };
+
+    for (Size p = 0; p < count; p++)
     {
-        FileListLinkedDestory(list);
-        OSXUnlinkItemAt(archive);
-        return false;
+        // Stored names all start with a '/', which patterns may leave out
+        String pattern = NULL;
+        asprintf(&pattern, "/%s", patterns[p] + strspn(patterns[p], "/"));
+
+        Size literal = strcspn(pattern, "*?[\\");
+        bool glob = pattern[literal] != 0;
+
+        // Globs are scanned from the last directory before their first wildcard
+        if (glob) while (literal && pattern[literal] != '/') literal--;
+        while (literal && pattern[literal - 1] == '/') literal--;
+
+        String base = strndup(pattern, literal);
+
+        if (table.parents) {
+            CAArchiveTableMatchTree(&table, pattern, glob, base, &keys);
+        } else {
+            if (!sorted) sorted = CAArchiveTableSortNames(&table);
+            CAArchiveTableMatchFlat(&table, sorted, pattern, glob, base, literal, &keys);
+        }
+
+        free(base);
+        free(pattern);
     }
 
-    MemoryAddress mapaddr = OSXMapFileFully(archive, NULL, true);
+    // Both key orders put every directory before its contents
+    if (keys.count) qsort(keys.keys, keys.count, sizeof(UInt64), CACompareKeys);
 
-    if (!mapaddr)
+    for (UInt64 k = 0; reporter.block && k < keys.count; k++)
     {
-        FileListLinkedDestory(list);
-        OSXUnlinkItemAt(archive);
-        return false;
+        if (k && keys.keys[k] == keys.keys[k - 1]) continue;
+
+        UInt64 index = sorted ? sorted[keys.keys[k]].index : keys.keys[k];
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, index, &info);
+        if (info.type == kEntryTypeDirectory && CADirectoryHandlesIsRoot(&table, index, &info)) continue;
+
+        reporter.event.entriesTotal++;
+        reporter.event.bytesTotal += info.size;
     }
 
-    memcpy(mapaddr, &header, sizeof(CAArchiveHeader));
-    Offset stringOffset = 0, dataOffset = 0, tocOffset = kCAHeaderSize;
-    FileListEntry *entry = list->head;
+    CADirectoryHandles handles;
+    bool opened = CADirectoryHandlesCreate(&handles, &table, outdir, NULL);
+    bool success = opened;
 
-    // Fix to make root directory be entered as '/' in the archive
-    bool freepath = false;
+    // Matches don't have to include their parents, so those are made as they're needed
+    handles.create = true;
 
-    if ((entry->path + nameshift)[0] != '/')
+    for (UInt64 k = 0; k < keys.count && success; k++)
     {
-        asprintf(&entry->path, "%s/", rootdir);
-        freepath = true;
+        if (k && keys.keys[k] == keys.keys[k - 1]) continue;
+
+        UInt64 index = sorted ? sorted[keys.keys[k]].index : keys.keys[k];
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, index, &info);
+
+        // The output directory stands in for the root
+        if (info.type == kEntryTypeDirectory && CADirectoryHandlesIsRoot(&table, index, &info)) continue;
+
+        int directory;
+        String basename;
+
+        if (CADirectoryHandlesResolve(&handles, index, &directory, &basename)) {
+            success = CAArchiveExtractEntryAt(&table, &info, directory, basename, &reporter);
+        } else {
+            CAReportEvent(&reporter, kCAEventFailed, info.name, info.size);
+            success = false;
+        }
     }
 
-    while (entry)
-    {
-        String entryName = entry->path + nameshift;
-        Size entryNameSize = strlen(entryName) + 1;
-        printf("A %s\n", entryName);
+    if (opened) CADirectoryHandlesDestroy(&handles);
+    free(keys.keys);
+    free(sorted);
 
-        CAArchiveEntry fileEntry = {
-            .nameOffset = (UInt32)stringOffset,
-            .type = entry->type,
-            .dataOffset = dataOffset,
-            .size = entry->size
-        };
+    CAArchiveTableClose(&table);
+    return success;
+}
+
+static bool CAIsZero(UInt8 *data, Size size)
+{
+    for (Size i = 0; i < size; i++)
+        if (data[i]) return false;
+
+    return true;
+}
+
+// Compares a sparse entry with a live file of the same logical size. All
+// of the live file outside the stored extents has to read as zeros, but
+// only its own data extents need to be looked at for that.
+static bool CAArchiveCompareSparse(MemoryAddress data, UInt64 size, Path path, UInt8 *live, Size liveSize)
+{
+    Size logicalSize;
+    UInt64 count;
+    MemoryAddress extentData;
+    UInt64 *extents = CAArchiveReadSparse(data, size, &logicalSize, &count, &extentData);
+    if (!extents) return false;
+
+    UInt8 *stored = extentData;
+    bool same = (logicalSize == liveSize);
+
+    for (UInt64 i = 0; i < count && same; i++)
+    {
+        same = !memcmp(live + extents[2 * i], stored, extents[(2 * i) + 1]);
+        stored += extents[(2 * i) + 1];
+    }
 
-        memcpy(mapaddr + tocOffset, &fileEntry, sizeof(CAArchiveEntry));
-        memcpy(mapaddr + (header.stringOffset + stringOffset), entryName, entryNameSize);
+    UInt64 *liveExtents, liveCount;
 
-        #define CACleanupAndReturnFalse()                \
-            do {                                    \
-                FileListLinkedDestory(list);        \
-                OSXUnmapFile(mapaddr, finalsize);   \
-                OSXUnlinkItemAt(archive);           \
-                return false;                       \
-            } while (0)
+    if (same && OSXReadFileExtents(path, liveSize, &liveExtents, &liveCount)) {
+        UInt64 s = 0;
 
-        switch (entry->type)
+        for (UInt64 i = 0; i < liveCount && same; i++)
         {
-            case kEntryTypeRegular: {
-                if (!OSXWriteFileTo(entry->path, mapaddr + (header.dataOffset + dataOffset)))
-                    CACleanupAndReturnFalse();
-            } break;
-            case kEntryTypeDirectory: {
-                // No data to store...
-            } break;
-            case kEntryTypeSymlink: {
-                String link = OSXReadLink(entry->path, NULL);
-                if (!link) CACleanupAndReturnFalse();
-
-                memcpy(mapaddr + (header.dataOffset + dataOffset), link, entry->size);
-                free(link);
-            } break;
-            default:
-                fprintf(stderr, "Error: Invalid entry type\n");
-                FileListLinkedDestory(list);
-                OSXUnmapFile(mapaddr, finalsize);
-                OSXUnlinkItemAt(archive);
-                return false;
+            UInt64 start = liveExtents[2 * i];
+            UInt64 end = start + liveExtents[(2 * i) + 1];
+
+            while (start < end && same)
+            {
+                while (s < count && extents[2 * s] + extents[(2 * s) + 1] <= start) s++;
+
+                if (s < count && extents[2 * s] <= start) {
+                    // Already compared
+                    start = extents[2 * s] + extents[(2 * s) + 1];
+                } else {
+                    UInt64 gapEnd = (s < count && extents[2 * s] < end) ? extents[2 * s] : end;
+                    same = CAIsZero(live + start, gapEnd - start);
+                    start = gapEnd;
+                }
+            }
         }
 
-        #undef CACleanupAndReturnFalse
-        stringOffset += entryNameSize;
-        dataOffset += entry->size;
-        tocOffset += kCAEntrySize;
+        free(liveExtents);
+    } else {
+        same = false;
+    }
+
+    free(extents);
+    return same;
+}
+
+// Type and size come first. Contents are only read if those match, and a
+// stored entry checksum saves reading the archive's copy.
+static bool CAArchiveCompareEntry(CAArchiveTable *table, CAArchiveEntryInfo *info, FileListEntry *entry)
+{
+    UInt8 type = (info->type == kEntryTypeSparse) ? kEntryTypeRegular : info->type;
+
+    if (type != entry->type) return false;
+    if (type == kEntryTypeDirectory) return true;
+
+    MemoryAddress data = CAArchiveTableGetData(table, info);
+    if (!data) return false;
 
-        entry = entry->next;
+    if (type == kEntryTypeSymlink)
+    {
+        if (info->size != entry->size) return false;
+
+        // The link may have been replaced since the scan. Its stored size counts the terminator.
+        String link = OSXReadLink(entry->path, NULL);
+        bool same = link && strlen(link) + 1 == info->size && !memcmp(link, data, info->size);
+        free(link);
+
+        return same;
     }
 
-    if (freepath) free(list->head->path);
-    FileListLinkedDestory(list);
+    Size size = entry->size;
 
-    header.checksum = OSXCalculateChecksum(mapaddr + kCAHeaderSize, finalsize - kCAHeaderSize);
-    header.headerChecksum = OSXCalculateChecksum(mapaddr, sizeof(CAArchiveHeader) - (2 * sizeof(UInt32)));
-    memcpy(mapaddr, &header, sizeof(CAArchiveHeader));
+    if (info->type == kEntryTypeSparse) {
+        CASparseHeader sparse;
+        if (info->size < sizeof(CASparseHeader)) return false;
 
-    OSXUnmapFile(mapaddr, finalsize);
-    return true;
+        memcpy(&sparse, data, sizeof(CASparseHeader));
+        if (CALittle64(sparse.logicalSize) != size) return false;
+    } else if (info->size != size) {
+        return false;
+    }
+
+    if (!size) return true;
+
+    // The size is checked again on the open file, as reading a mapping past
+    // the end of a file that shrank since the scan would fault
+    int fd = open(entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    FileStats stats;
+
+    if (fd < 0 || fstat(fd, &stats) || (Size)stats.st_size != size)
+    {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    UInt8 *live = mmap(NULL, size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (live == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Could not map file at '%s' into memory\n", entry->path);
+        perror("mmap");
+        return false;
+    }
+
+    bool same;
+
+    if (info->type == kEntryTypeSparse) {
+        same = CAArchiveCompareSparse(data, info->size, entry->path, live, size);
+    } else if (table->checksums) {
+        same = (CAChecksum(table->checksumType, live, size) == CALittle64(table->checksums[info->index]));
+    } else {
+        same = !memcmp(live, data, size);
+    }
+
+    OSXUnmapFile(live, size);
+    return same;
 }
 
-bool CAArchiveExtractItem(Path archive, String item, Path output)
+// Flat tables are searched through their names sorted by CAArchiveTableSortNames
+static bool CAArchiveTableFind(CAArchiveTable *table, CANameIndexEntry *sorted, String path, UInt64 *index)
 {
-    Size mapsize = -1;
-    MemoryAddress mapaddr = OSXMapFileFully(archive, &mapsize, false);
-    CAArchiveHeader *header = (CAArchiveHeader *)mapaddr;
-    Offset currentOffset = kCAHeaderSize;
-    if (!mapaddr) return NULL;
-    
-    while (currentOffset < header->stringOffset)
-    {
-        CAArchiveEntry *entry = (CAArchiveEntry *)(mapaddr + currentOffset);
-        String name = mapaddr + (header->stringOffset + entry->nameOffset);
-        currentOffset += sizeof(CAArchiveEntry);
-        if (strcmp(name, item)) continue;
-        printf("X %s\n", name);
-
-        MemoryAddress data = mapaddr + (header->dataOffset + entry->dataOffset);
-
-        #define CACleanupAndReturnFalse()       \
-            do {                                \
-                OSXUnmapFile(mapaddr, mapsize); \
-                return false;                   \
-            } while (0)
-
-        switch (entry->type)
-        {
-            case kEntryTypeRegular: {
-                if (!OSXWriteDataToFile(data, entry->size, output))
-                    CACleanupAndReturnFalse();
-            } break;
-            case kEntryTypeDirectory: {
-                if (!OSXCreateDirectoryAt(output))
-                    CACleanupAndReturnFalse();
-            } break;
-            case kEntryTypeSymlink: {
-                if (OSXFileExists(output))
-                {
-                    fprintf(stderr, "Warning: file '%s' already exists. Will ignore\n", output);
-                    break;
-                }
+    if (!sorted) return CAArchiveTableLookup(table, path, index);
 
-                if (!OSXCreateSymlink(data, output)) CACleanupAndReturnFalse();
-            } break;
-            default:
-                fprintf(stderr, "Error: Invalid Entry type 0x%02X", entry->type);
-                CACleanupAndReturnFalse();
-        }
-        
-        #undef CACleanupAndReturnFalse
-    }
-    
-    OSXUnmapFile(mapaddr, mapsize);
+    CANameIndexEntry key = { .name = path, .index = 0 };
+    CANameIndexEntry *found = bsearch(&key, sorted, table->count, sizeof(CANameIndexEntry), CACompareNameIndexEntries);
+    if (!found) return false;
+
+    *index = found->index;
     return true;
 }
 
-bool CAArchiveExtractAll(Path archive, Path outdir)
+bool CAArchiveCompare(Path archive, Path rootdir, void (^block)(UInt8, String, MemoryAddress), MemoryAddress userinfo)
 {
-    Size mapsize = -1;
-    MemoryAddress mapaddr = OSXMapFileFully(archive, &mapsize, false);
-    CAArchiveHeader *header = (CAArchiveHeader *)mapaddr;
-    Offset currentOffset = kCAHeaderSize;
-    if (!mapaddr) return NULL;
-    
-    while (currentOffset < header->stringOffset)
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, true)) return false;
+
+    FileListLinked *list = FileListLinkedCreate();
+
+    if (!FileListLinkedAddDirectory(list, rootdir))
     {
-        CAArchiveEntry *entry = (CAArchiveEntry *)(mapaddr + currentOffset);
-        String name = mapaddr + (header->stringOffset + entry->nameOffset);
-        printf("X %s\n", name);
+        FileListLinkedDestory(list);
+        CAArchiveTableClose(&table);
+        return false;
+    }
+
+    CANameIndexEntry *sorted = table.parents ? NULL : CAArchiveTableSortNames(&table);
+    UInt8 *seen = calloc(table.count ? table.count : 1, sizeof(UInt8));
+    Size nameshift = strlen(rootdir);
+    bool matches = true;
 
-        MemoryAddress data = mapaddr + (header->dataOffset + entry->dataOffset);
-        String outfile; asprintf(&outfile, "%s%s", outdir, name);
+    for (FileListEntry *entry = list->head; entry; entry = entry->next)
+    {
+        // The roots always match
+        String name = entry->path + nameshift;
+        if (!*name) continue;
 
-        #define CACleanupAndReturnFalse()       \
-            do {                                \
-                OSXUnmapFile(mapaddr, mapsize); \
-                return false;                   \
-            } while (0)
+        UInt8 status = kCACompareAdded;
+        UInt64 index;
 
-        switch (entry->type)
+        if (CAArchiveTableFind(&table, sorted, name, &index))
         {
-            case kEntryTypeRegular: {
-                if (!OSXWriteDataToFile(data, entry->size, outfile))
-                    CACleanupAndReturnFalse();
-            } break;
-            case kEntryTypeDirectory: {
-                if (!OSXCreateDirectoryAt(outfile))
-                    CACleanupAndReturnFalse();
-            } break;
-            case kEntryTypeSymlink: {
-                if (OSXFileExists(outfile))
-                {
-                    fprintf(stderr, "Warning: file '%s' already exists. Will ignore\n", outfile);
-                    break;
-                }
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(&table, index, &info);
 
-                if (!OSXCreateSymlink(data, outfile)) CACleanupAndReturnFalse();
-            } break;
-            default:
-                fprintf(stderr, "Error: Invalid Entry type 0x%02X", entry->type);
-                CACleanupAndReturnFalse();
+            seen[index] = 1;
+            status = CAArchiveCompareEntry(&table, &info, entry) ? kCACompareSame : kCACompareChanged;
         }
 
-        #undef CACleanupAndReturnFalse
-        currentOffset += sizeof(CAArchiveEntry);
+        if (status != kCACompareSame) matches = false;
+        block(status, name, userinfo);
     }
 
-    OSXUnmapFile(mapaddr, mapsize);
-    return true;
+    for (UInt64 i = 0; i < table.count; i++)
+    {
+        if (seen[i]) continue;
+
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, i, &info);
+        if (!info.nameLength || (info.nameLength == 1 && info.name[0] == '/')) continue;
+
+        matches = false;
+        block(kCACompareRemoved, info.name, userinfo);
+    }
+
+    free(seen);
+    free(sorted);
+    FileListLinkedDestory(list);
+    CAArchiveTableClose(&table);
+    return matches;
 }
 
 String *CAArchiveListContents(Path archive, Size *count)
 {
-    CAArchiveHeader *header = (CAArchiveHeader *)OSXMapFile(archive, kCAHeaderSize, 0, false);
-    if (!header) return NULL;
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, false)) return NULL;
 
-    UInt64 dataOffset = header->dataOffset;
-    OSXUnmapFile(header, kCAHeaderSize);
+    // The array and every name live in a single allocation
+    Size namesize = 0;
 
-    MemoryAddress mapaddr = OSXMapFile(archive, dataOffset, 0, false);
-    header = (CAArchiveHeader *)mapaddr;
-    if (!mapaddr) return NULL;
+    for (UInt64 i = 0; i < table.count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, i, &info);
+        namesize += info.nameLength + 1;
+    }
 
-    UInt64 filecount = (header->stringOffset - kCAHeaderSize) / kCAEntrySize;
-    String *entries = calloc(filecount, sizeof(String));
-    Offset currentOffset = kCAHeaderSize;
-    UInt64 i = 0;
+    String *entries = malloc((table.count * sizeof(String)) + namesize);
+    String names = (String)(entries + table.count);
 
-    while (currentOffset < header->stringOffset)
+    for (UInt64 i = 0; i < table.count; i++)
     {
-        CAArchiveEntry *entry = (CAArchiveEntry *)(mapaddr + currentOffset);
-        String name = mapaddr + (header->stringOffset + entry->nameOffset);
-        Size nameSize = strlen(name) + 1;
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, i, &info);
 
-        entries[i] = malloc(nameSize);
-        memcpy(entries[i], name, nameSize);
+        memcpy(names, info.name, info.nameLength);
+        names[info.nameLength] = 0;
 
-        printf("L %s\n", name);
-        currentOffset += sizeof(CAArchiveEntry);
+        entries[i] = names;
+        names += info.nameLength + 1;
     }
 
-    OSXUnmapFile(mapaddr, dataOffset);
-    if (count) *count = filecount;
+    if (count) *count = table.count;
+    CAArchiveTableClose(&table);
     return entries;
 }
 
+bool CAArchiveIterateContents(Path archive, bool (^block)(CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, false)) return false;
+    bool result = true;
+
+    for (UInt64 i = 0; i < table.count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, i, &info);
+
+        if (!block(&info, userinfo))
+        {
+            result = false;
+            break;
+        }
+    }
+
+    CAArchiveTableClose(&table);
+    return result;
+}
+
+bool CAArchiveWriteContents(Path archive, int fd)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, false)) return false;
+
+    OSXOutputBuffer *output = OSXOutputBufferCreate(fd);
+    bool success = true;
+
+    for (UInt64 i = 0; i < table.count && success; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&table, i, &info);
+
+        success = OSXOutputBufferAppend(output, "L ", 2)
+               && OSXOutputBufferAppend(output, info.name, info.nameLength)
+               && OSXOutputBufferAppend(output, "\n", 1);
+    }
+
+    success = OSXOutputBufferDestroy(output) && success;
+    CAArchiveTableClose(&table);
+    return success;
+}
+
+static void CAShardCheckWorker(MemoryAddress context, Size index)
+{
+    CAArchiveTable *table = context;
+    CAArchiveShardMap *shard = &table->shards[index];
+
+    // The checksum is replaced by whether it matched
+    shard->checksum = (CAChecksum(table->checksumType, shard->mapaddr + kCAShardHeaderSize, shard->dataSize) == shard->checksum);
+}
+
+// Checks every shard at once
+static bool CAArchiveCheckShards(Path archive)
+{
+    CAArchiveTable table;
+    if (!CAArchiveTableOpen(archive, &table, true)) return false;
+
+    OSXApplyConcurrently(table.shardCount, &table, CAShardCheckWorker);
+    bool valid = true;
+
+    for (UInt32 s = 0; s < table.shardCount; s++)
+        if (!table.shards[s].checksum) valid = false;
+
+    CAArchiveTableClose(&table);
+    return valid;
+}
+
 bool CAArchiveCheckValidity(Path archive)
 {
-    CAArchiveHeader *header = (CAArchiveHeader *)OSXMapFile(archive, kCAHeaderSize, 0, false);
+    MemoryAddress header = OSXMapFile(archive, kCAHeader5Size, 0, false);
     if (!header) return false;
 
     #define CACleanupAndReturnFalse()               \
         do {                                        \
-            OSXUnmapFile(header, kCAHeaderSize);    \
+            OSXUnmapFile(header, kCAHeader5Size);   \
             return false;                           \
         } while (0)
 
-    char magic[4] = kCAMagic;
-    if (memcmp(header->magic, magic, 4)) CACleanupAndReturnFalse();
-
-    char version[3] = kCAVersion4;
-    if (memcmp(header->version, version, 3)) CACleanupAndReturnFalse();
-
-    UInt32 hcheck = OSXCalculateChecksum((UInt8 *)header, kCAHeaderSize - (2 * sizeof(UInt32)));
-    if (hcheck != header->headerChecksum) CACleanupAndReturnFalse();
+    UInt8 version = CAArchiveVersion(header);
+    if (!CAArchiveHeaderIsValid(header, kCAHeader5Size)) CACleanupAndReturnFalse();
 
-    OSXUnmapFile(header, kCAHeaderSize); Size mapsize = -1;
+    OSXUnmapFile(header, kCAHeader5Size); Size mapsize = -1;
     MemoryAddress data = OSXMapFileFully(archive, &mapsize, false);
-    header = (CAArchiveHeader *)data;
     if (!data) return false;
 
-    UInt32 checksum = OSXCalculateChecksum(data + kCAHeaderSize, mapsize - kCAHeaderSize);
-    bool valid = checksum == header->checksum;
+    #undef CACleanupAndReturnFalse
+    #define CACleanupAndReturnFalse()               \
+        do {                                        \
+            OSXUnmapFile(data, mapsize);            \
+            return false;                           \
+        } while (0)
+
+    CAArchiveTable table;
+    if (!CAArchiveTableLoadHeader(&table, data, mapsize)) CACleanupAndReturnFalse();
+
+    Size checkedsize = table.dataOffset + table.dataSize;
+    Size expectedsize = checkedsize;
+
+    if (table.flags & kCAFlagChunkHashes)
+    {
+        CAArchiveChunkTrailer trailer;
+        if (!CAArchiveReadChunkTrailer(&table, &trailer) || trailer.dataSize != table.dataSize) CACleanupAndReturnFalse();
+
+        UInt64 *nodes = (UInt64 *)(data + CAChunkTreeOffset(table.dataOffset, table.dataSize));
+
+        if (trailer.chunkCount && !CAChunkVerifyTree(table.checksumType, nodes, trailer.chunkCount, 0, trailer.chunkCount - 1, trailer.root))
+            CACleanupAndReturnFalse();
+
+        expectedsize = mapsize;
+    }
+
+    // The shard table stands in for the data and is checked as a whole
+    if (table.flags & kCAFlagSharded)
+    {
+        if (table.dataOffset + sizeof(CAArchiveShardTable) > mapsize) CACleanupAndReturnFalse();
+        checkedsize = expectedsize = mapsize;
+    }
+
+    if (expectedsize != mapsize) CACleanupAndReturnFalse();
+
+    Size headersize = (version == 4) ? kCAHeaderSize : kCAHeader5Size;
+    UInt64 checksum = CAChecksum(table.checksumType, data + headersize, checkedsize - headersize);
+    bool valid = checksum == table.checksum;
     OSXUnmapFile(data, mapsize);
 
+    if (valid && (table.flags & kCAFlagSharded))
+        valid = CAArchiveCheckShards(archive);
+
     #undef CACleanupAndReturnFalse
     return valid;
 }
 
+bool CAArchiveVerifyChunks(Path archive, UInt64 offset, UInt64 length, void (^block)(UInt64, CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo)
+{
+    Size mapsize = -1;
+    MemoryAddress mapaddr = OSXMapFileFully(archive, &mapsize, false);
+    if (!mapaddr) return false;
+
+    // The header says where the data is and whether there are hashes at all
+    if (!CAArchiveHeaderIsValid(mapaddr, mapsize))
+    {
+        fprintf(stderr, "Error: Archive at '%s' has a damaged header\n", archive);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    CAArchiveTable table;
+    CAArchiveChunkTrailer trailer;
+    bool chunked = CAArchiveTableLoadHeader(&table, mapaddr, mapsize) && CAArchiveReadChunkTrailer(&table, &trailer);
+
+    if (!chunked)
+    {
+        fprintf(stderr, "Error: Archive at '%s' has no valid chunk hashes\n", archive);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    if (offset >= trailer.dataSize)
+    {
+        OSXUnmapFile(mapaddr, mapsize);
+        return true;
+    }
+
+    // A zero length means 'through the end of the data region'
+    if (!length || length > trailer.dataSize - offset) length = trailer.dataSize - offset;
+
+    UInt64 lo = offset >> trailer.chunkShift;
+    UInt64 hi = (offset + length - 1) >> trailer.chunkShift;
+    UInt64 *nodes = (UInt64 *)(mapaddr + CAChunkTreeOffset(table.dataOffset, trailer.dataSize));
+
+    if (!CAChunkVerifyTree(table.checksumType, nodes, trailer.chunkCount, lo, hi, trailer.root))
+    {
+        if (block) block(kCAChunkTreeDamaged, NULL, userinfo);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    UInt64 count = (hi - lo) + 1;
+    UInt8 *damaged = calloc(count, sizeof(UInt8));
+
+    if (!damaged)
+    {
+        fprintf(stderr, "Error: Could not allocate memory to check %llu chunks\n", (unsigned long long)count);
+        OSXUnmapFile(mapaddr, mapsize);
+        return false;
+    }
+
+    CAChunkContext context = {
+        .data = mapaddr + table.dataOffset,
+        .dataSize = trailer.dataSize,
+        .chunkShift = trailer.chunkShift,
+        .checksumType = table.checksumType,
+        .first = lo,
+        .hashes = nodes,
+        .damaged = damaged
+    };
+
+    OSXApplyConcurrently(count, &context, CAChunkHashWorker);
+    bool valid = true;
+
+    for (UInt64 i = 0; i < count && valid; i++)
+        valid = !damaged[i];
+
+    // Only walk the TOC to attribute damage when there is some
+    if (!valid && block && CAArchiveTableLoad(&table, mapaddr, mapsize))
+    {
+        for (UInt64 i = 0; i < table.count; i++)
+        {
+            CAArchiveEntryInfo info;
+            CAArchiveTableGetEntry(&table, i, &info);
+            if (!info.size || info.dataOffset >= trailer.dataSize) continue;
+
+            UInt64 first = info.dataOffset >> trailer.chunkShift;
+            UInt64 last = (info.dataOffset + info.size - 1) >> trailer.chunkShift;
+            if (first < lo) first = lo;
+            if (last > hi) last = hi;
+
+            for (UInt64 chunk = first; chunk <= last; chunk++)
+            {
+                if (!damaged[chunk - lo]) continue;
+
+                block(chunk, &info, userinfo);
+                damaged[chunk - lo] = 2;
+            }
+        }
+
+        CAArchiveTableUnload(&table);
+    }
+
+    if (!valid && block)
+    {
+        for (UInt64 i = 0; i < count; i++)
+            if (damaged[i] == 1) block(lo + i, NULL, userinfo);
+    }
+
+    free(damaged);
+    OSXUnmapFile(mapaddr, mapsize);
+    return valid;
+}
+
+#pragma mark - Handles
+
+struct CAArchiveHandle {
+    CAArchiveTable table;
+    CANameIndexEntry *sorted;   // Flat tables only, hierarchical ones are searched by parent
+};
+
+CAArchiveHandle *CAArchiveHandleOpen(Path archive)
+{
+    CAArchiveHandle *handle = malloc(sizeof(CAArchiveHandle));
+
+    if (!CAArchiveTableOpen(archive, &handle->table, true))
+    {
+        free(handle);
+        return NULL;
+    }
+
+    handle->sorted = handle->table.parents ? NULL : CAArchiveTableSortNames(&handle->table);
+    return handle;
+}
+
+bool CAArchiveHandleFind(CAArchiveHandle *handle, String name, CAArchiveEntryInfo *info)
+{
+    UInt64 index;
+    if (!CAArchiveTableFind(&handle->table, handle->sorted, name, &index)) return false;
+
+    CAArchiveTableGetEntry(&handle->table, index, info);
+    return true;
+}
+
+bool CAArchiveHandleIterate(CAArchiveHandle *handle, bool (^block)(CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo)
+{
+    for (UInt64 i = 0; i < handle->table.count; i++)
+    {
+        CAArchiveEntryInfo info;
+        CAArchiveTableGetEntry(&handle->table, i, &info);
+
+        if (!block(&info, userinfo)) return false;
+    }
+
+    return true;
+}
+
+MemoryAddress CAArchiveHandleGetData(CAArchiveHandle *handle, CAArchiveEntryInfo *info)
+{
+    return CAArchiveTableGetData(&handle->table, info);
+}
+
+bool CAArchiveHandleExtract(CAArchiveHandle *handle, CAArchiveEntryInfo *info, Path output)
+{
+    CAEventReporter reporter;
+    CAEventReporterStart(&reporter, NULL, NULL);
+
+    return CAArchiveExtractEntry(&handle->table, info, output, &reporter);
+}
+
+void CAArchiveHandleClose(CAArchiveHandle *handle)
+{
+    free(handle->sorted);
+    CAArchiveTableClose(&handle->table);
+    free(handle);
+}
+
 // Note yet...
 void CAArchivePrintInfo(Path archive, bool entries);
@@ -3,11 +3,60 @@
 
 #include "syscalls.h"
 #include "lists.h"
+#include "iobatch.h"
 
-#define kCAMagic      {'C', 'A', 'R', 0x0}
-#define kCAVersion4   {'4', '.', '0'}
-#define kCAHeaderSize 32
-#define kCAEntrySize  sizeof(CAArchiveEntry)
+#define kCAMagic       {'C', 'A', 'R', 0x0}
+#define kCAVersion4    {'4', '.', '0'}
+#define kCAVersion5    {'5', '.', '0'}
+#define kCAHeaderSize  32
+#define kCAHeader5Size 64
+#define kCAEntrySize   sizeof(CAArchiveEntry)
+
+#define kCAChecksumCRC32  0
+#define kCAChecksumCRC32C 1
+#define kCAChecksumXXH64  2
+#define kCAChecksumCount  3
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    #define CALittle32(x) __builtin_bswap32(x)
+    #define CALittle64(x) __builtin_bswap64(x)
+#else
+    #define CALittle32(x) (x)
+    #define CALittle64(x) (x)
+#endif
+
+#define kCAFlagChunkHashes       (1 << 0)
+#define kCAFlagHierarchicalNames (1 << 1)
+#define kCAFlagSharded           (1 << 2)
+#define kCAFlagEntryChecksums    (1 << 3)
+
+#define kCAChunkMagic        {'C', 'A', 'M', 'T'}
+#define kCAChunkTrailerSize  sizeof(CAArchiveChunkTrailer)
+#define kCAChunkShiftDefault 20
+#define kCAChunkShiftMin     12
+#define kCAChunkShiftMax     40
+#define kCAChunkTreeDamaged  UINT64_MAX
+
+#define kCAReadaheadDefault  (1 << 24)
+#define kCAOpenDirectoriesMax 4096
+
+#define kCACompareSame       '='
+#define kCACompareChanged    'M'
+#define kCACompareAdded      'A'
+#define kCACompareRemoved    'D'
+
+#define kCAEventScanned      'L'
+#define kCAEventStarted      'S'
+#define kCAEventFinished     'F'
+#define kCAEventFailed       'E'
+
+#define kCAMergeFail         0
+#define kCAMergeKeepFirst    1
+#define kCAMergeKeepLast     2
+
+#define kCAShardMagic        {'C', 'A', 'R', 'S'}
+#define kCAShardHeaderSize   sizeof(CAArchiveShardHeader)
+#define kCAShardsMax         256
 
 typedef struct {
     char magic[4];
@@ -26,11 +75,199 @@ typedef struct {
     UInt64 size;
 } CAArchiveEntry;
 
-extern bool CAArchiveCreate(Path archive, Path rootdir);
-extern bool CAArchiveExtractItem(Path archive, String item, Path output);
-extern bool CAArchiveExtractAll(Path archive, Path outdir);
+// Version 5 archives are little-endian and explicitly packed. The header is
+// followed by a columnar TOC, each column starting on an 8 byte boundary:
+//
+//   UInt8  type[entryCount]
+//   UInt64 nameOffset[entryCount]
+//   UInt64 dataOffset[entryCount]
+//   UInt64 parent[entryCount]       (only with kCAFlagHierarchicalNames)
+//   UInt64 checksum[entryCount]     (only with kCAFlagEntryChecksums)
+//   varint size[entryCount] (unsigned LEB128)
+//
+// and then the string table at stringOffset and the data at dataOffset.
+//
+// With kCAFlagHierarchicalNames each name is only a basename and `parent`
+// is the index of the containing directory. Entries are then stored
+// breadth first: the root is entry 0 (with an empty name), parents are
+// non-decreasing and each directory's children are contiguous and sorted
+// by basename, so their names form one run of the string table.
+// With kCAFlagEntryChecksums every entry carries the checksum of its data
+// as stored, so single entries can be checked without reading the others.
+// headerChecksum (always CRC32) covers everything before `checksum`, and
+// `checksum` covers everything from the end of the header to the end of
+// the data. `checksumType` picks the algorithm for `checksum`, the entry
+// and shard checksums and the chunk hashes: one of the kCAChecksum ids.
+// `trailerChecksum` is the chunk trailer's own checksum (see below), or 0.
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    char version[3];
+    UInt8 checksumType;
+    UInt32 flags;
+    UInt32 trailerChecksum;
+    UInt64 entryCount;
+    UInt64 stringOffset;
+    UInt64 dataOffset;
+    UInt64 dataSize;
+    UInt64 checksum;
+    UInt32 headerChecksum;
+    UInt32 reserved2;
+} CAArchiveHeader5;
+
+// Archives with kCAFlagChunkHashes set carry a Merkle tree over fixed-size
+// chunks of the data region. The tree nodes start at the first 8 byte
+// boundary after the data region and go level by level (leaves first), and
+// this trailer sits at the very end of the file. Nodes and trailer fields
+// are little-endian. header.checksum then covers only up to the end of the
+// data region. The trailer's checksum covers the root, so a version 5
+// header ties the whole tree to itself through trailerChecksum; a version 4
+// header has no room for it, and there the tree is only as trustworthy as
+// its trailer.
+typedef struct {
+    char magic[4];
+    UInt32 chunkShift;
+    UInt64 dataSize;
+    UInt64 chunkCount;
+    UInt64 root;
+    UInt32 reserved;
+    UInt32 checksum;
+} CAArchiveChunkTrailer;
+
+// The data of a kEntryTypeSparse entry starts with this header and
+// `extentCount` little-endian (offset, length) pairs, followed by the
+// contents of each extent in turn. Everything else is a hole. Like all
+// entry data it starts wherever the previous entry's ends, unaligned.
+typedef struct {
+    UInt64 logicalSize;
+    UInt64 extentCount;
+} CASparseHeader;
+
+// Archives with kCAFlagSharded set keep their data in separate shard files
+// named <archive>.0, <archive>.1 and so on. Entry data offsets still index
+// one data region of dataSize bytes, of which each shard holds the piece
+// described by its CAArchiveShard. In the archive itself this table takes
+// the place of the data at dataOffset, and header.checksum covers it too.
+// Everything is little-endian. The table follows the string table directly,
+// so it isn't necessarily aligned.
+typedef struct __attribute__((packed)) {
+    UInt64 dataStart;
+    UInt64 dataSize;
+    UInt64 checksum;        // Of the shard's data
+} CAArchiveShard;
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    UInt32 shardCount;
+    CAArchiveShard shards[];
+} CAArchiveShardTable;
+
+// Each shard file starts with this header and its data follows directly.
+// headerChecksum covers everything before it.
+typedef struct {
+    char magic[4];
+    UInt32 index;
+    UInt64 dataStart;
+    UInt64 dataSize;
+    UInt32 reserved;
+    UInt32 headerChecksum;
+} CAArchiveShardHeader;
+
+// Reported while an archive is created or extracted. kCAEventScanned is
+// sent for every path found while scanning the tree to archive. Every entry
+// is then kCAEventStarted and kCAEventFinished or kCAEventFailed (the
+// details of a failure go to stderr). Entries handed to a batch count as
+// finished once they are queued. The counts include the current entry and
+// a total of 0 is unknown. `name` is only valid for the duration of the
+// call. Calls never overlap, but may come from any thread.
+typedef struct {
+    UInt8 type;
+    String name;
+    UInt64 size;            // Of the entry's data as stored
+    UInt64 entriesDone;
+    UInt64 entriesTotal;
+    UInt64 bytesDone;
+    UInt64 bytesTotal;
+} CAArchiveEvent;
+
+typedef void (^CAArchiveEventBlock)(CAArchiveEvent *event, MemoryAddress userinfo);
+
+typedef struct {
+    UInt8 version;          // 4 (the default) or 5
+    UInt32 chunkShift;      // 0 disables chunk hashes
+    bool hierarchicalNames; // Version 5 only
+    bool sparseFiles;       // Store only the data extents of sparse files
+    UInt32 shards;          // Version 5 only, 0 or 1 keeps all data in the archive
+    bool entryChecksums;    // Version 5 only
+    UInt8 checksumType;     // Version 5 only, one of the kCAChecksum ids
+    CAArchiveEventBlock events;
+    MemoryAddress userinfo;
+} CAArchiveOptions;
+
+// Only CAArchiveExtractAll reads ahead
+typedef struct {
+    UInt64 readahead;       // Bytes to read ahead of the writer, 0 disables it
+    CAArchiveEventBlock events;
+    MemoryAddress userinfo;
+} CAArchiveExtractOptions;
+
+// One archive to merge and the directory its contents go under in the
+// merged archive ("" or "/" for the root). Directories which are in several
+// inputs are merged; any other name found in several is settled by the
+// kCAMerge policy: fail, or keep the entry of the first or last input.
+// The merged archive takes CAArchiveOptions like a new one, but can't have
+// shards (and sparseFiles has no effect).
+typedef struct {
+    Path archive;
+    String prefix;
+} CAArchiveMergeInput;
+
+// A view of one entry in a mapped archive. `name` points straight into
+// the archive's string table (or, for hierarchical names, into a buffer
+// the path is rebuilt in) and is only valid for the duration of the
+// callback.
+typedef struct {
+    String name;
+    Size nameLength;
+    UInt8 type;
+    UInt64 size;
+    UInt64 dataOffset;
+    UInt64 index;
+} CAArchiveEntryInfo;
+
+// An archive kept open with its table parsed and indexed, for repeated
+// lookups. Entry names point into the mapping (or, for hierarchical names,
+// into a buffer the handle reuses) and are valid until the next call on the
+// handle; data points into the mapping and is valid until the handle is
+// closed. Calls on one handle must not overlap.
+typedef struct CAArchiveHandle CAArchiveHandle;
+
+// CAArchiveExtractMatching takes prefixes, which match whole path components
+// ("svc" matches "/svc" and everything under it, not "/svc2"), and globs,
+// whose wildcards never match a '/' (fnmatch with FNM_PATHNAME). A leading
+// '/' is optional for either.
+
+extern bool CAArchiveCreate(Path archive, Path rootdir, CAArchiveOptions *options);
+extern bool CAArchiveMerge(Path archive, CAArchiveMergeInput *inputs, Size count, UInt8 policy, CAArchiveOptions *options);
+extern bool CAArchiveExtractItem(Path archive, String item, Path output, CAArchiveExtractOptions *options);
+extern bool CAArchiveExtractAll(Path archive, Path outdir, CAArchiveExtractOptions *options);
+extern bool CAArchiveExtractMatching(Path archive, String *patterns, Size count, Path outdir, CAArchiveExtractOptions *options);
+extern bool CAArchiveCompare(Path archive, Path rootdir, void (^block)(UInt8, String, MemoryAddress), MemoryAddress userinfo);
 extern String *CAArchiveListContents(Path archive, Size *count);
+extern bool CAArchiveIterateContents(Path archive, bool (^block)(CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo);
+extern bool CAArchiveWriteContents(Path archive, int fd);
 extern bool CAArchiveCheckValidity(Path archive);
+extern bool CAArchiveVerifyChunks(Path archive, UInt64 offset, UInt64 length, void (^block)(UInt64, CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo);
 extern void CAArchivePrintInfo(Path archive, bool entries);
 
+extern CAArchiveHandle *CAArchiveHandleOpen(Path archive);
+extern bool CAArchiveHandleFind(CAArchiveHandle *handle, String name, CAArchiveEntryInfo *info);
+extern bool CAArchiveHandleIterate(CAArchiveHandle *handle, bool (^block)(CAArchiveEntryInfo *, MemoryAddress), MemoryAddress userinfo);
+extern MemoryAddress CAArchiveHandleGetData(CAArchiveHandle *handle, CAArchiveEntryInfo *info);
+extern bool CAArchiveHandleExtract(CAArchiveHandle *handle, CAArchiveEntryInfo *info, Path output);
+extern void CAArchiveHandleClose(CAArchiveHandle *handle);
+
+// CAArchiveListContents    --> Call free (once, on the returned array)
+// CAArchiveIterateContents --> N/A
+// CAArchiveHandleOpen      --> Call CAArchiveHandleClose
+
 #endif /* !defined(__CAR_ARCHIVE__) */
@@ -0,0 +1,173 @@
+#include "client.h"
+
+struct CAClient {
+    int fd;
+    UInt32 status;
+};
+
+#pragma mark - Requests
+
+// Sends one request and reads the answer's header. True only if the answer
+// is kCAStatusOK, and the caller then reads `length` bytes of payload.
+static bool CAClientRequest(CAClient *client, UInt8 type, Path archive, String name, Path output, UInt64 offset, UInt64 length, UInt64 *payload)
+{
+    if (client->status == kCAStatusLost) return false;
+
+    if (!name) name = "";
+    if (!output) output = "";
+
+    Size archiveLength = strlen(archive), nameLength = strlen(name), outputLength = strlen(output);
+
+    if (archiveLength > kCAServerStringMax || nameLength > kCAServerStringMax || outputLength > kCAServerStringMax)
+    {
+        client->status = kCAStatusBadRequest;
+        return false;
+    }
+
+    // The request and its strings go out in one send
+    Size size = sizeof(CAServerRequest) + archiveLength + nameLength + outputLength;
+    UInt8 *buffer = malloc(size);
+
+    CAServerRequest request = {
+        .magic = kCAServerMagic, .type = type, .reserved = { 0 },
+        .archiveLength = (UInt32)archiveLength, .nameLength = (UInt32)nameLength, .outputLength = (UInt32)outputLength,
+        .reserved2 = 0, .offset = offset, .length = length
+    };
+
+    memcpy(buffer, &request, sizeof(CAServerRequest));
+    memcpy(buffer + sizeof(CAServerRequest), archive, archiveLength);
+    memcpy(buffer + sizeof(CAServerRequest) + archiveLength, name, nameLength);
+    memcpy(buffer + sizeof(CAServerRequest) + archiveLength + nameLength, output, outputLength);
+
+    CAServerResponse response;
+    bool sent = OSXSendFully(client->fd, buffer, size) && OSXReceiveFully(client->fd, &response, sizeof(CAServerResponse));
+    free(buffer);
+
+    if (!sent)
+    {
+        fprintf(stderr, "Error: Lost the connection to the server\n");
+        client->status = kCAStatusLost;
+        return false;
+    }
+
+    client->status = response.status;
+    if (response.status != kCAStatusOK) return false;
+
+    *payload = response.length;
+    return true;
+}
+
+static bool CAClientReceive(CAClient *client, MemoryAddress buffer, UInt64 length)
+{
+    if (OSXReceiveFully(client->fd, buffer, length)) return true;
+
+    fprintf(stderr, "Error: Lost the connection to the server\n");
+    client->status = kCAStatusLost;
+    return false;
+}
+
+#pragma mark - Client
+
+CAClient *CAClientConnect(Path socket)
+{
+    int fd = OSXConnectToSocket(socket);
+    if (fd < 0) return NULL;
+
+    CAClient *client = malloc(sizeof(CAClient));
+    client->fd = fd;
+    client->status = kCAStatusOK;
+    return client;
+}
+
+// The status of the last call
+UInt32 CAClientStatus(CAClient *client)
+{
+    return client->status;
+}
+
+String *CAClientList(CAClient *client, Path archive, Size *count)
+{
+    UInt64 length;
+    if (!CAClientRequest(client, kCARequestList, archive, NULL, NULL, 0, 0, &length)) return NULL;
+
+    String names = malloc(length ? length : 1);
+
+    if (!CAClientReceive(client, names, length))
+    {
+        free(names);
+        return NULL;
+    }
+
+    // The array and every name live in a single allocation, like CAArchiveListContents
+    Size total = 0;
+    for (UInt64 i = 0; i < length; i++) total += !names[i];
+
+    String *entries = malloc((total * sizeof(String)) + length);
+    String copy = (String)(entries + total);
+    memcpy(copy, names, length);
+    free(names);
+
+    for (Size i = 0; i < total; i++)
+    {
+        entries[i] = copy;
+        copy += strlen(copy) + 1;
+    }
+
+    if (count) *count = total;
+    return entries;
+}
+
+bool CAClientStat(CAClient *client, Path archive, String name, CAServerEntryStat *stat)
+{
+    UInt64 length;
+    if (!CAClientRequest(client, kCARequestStat, archive, name, NULL, 0, 0, &length)) return false;
+
+    if (length != sizeof(CAServerEntryStat))
+    {
+        fprintf(stderr, "Error: Unexpected answer from the server\n");
+        client->status = kCAStatusLost;
+        return false;
+    }
+
+    return CAClientReceive(client, stat, sizeof(CAServerEntryStat));
+}
+
+// Up to `length` bytes of an entry's data as stored, from `offset` on
+MemoryAddress CAClientRead(CAClient *client, Path archive, String name, UInt64 offset, UInt64 length, Size *size)
+{
+    UInt64 received;
+    if (!CAClientRequest(client, kCARequestRead, archive, name, NULL, offset, length, &received)) return NULL;
+
+    MemoryAddress data = malloc(received ? received : 1);
+
+    if (!CAClientReceive(client, data, received))
+    {
+        free(data);
+        return NULL;
+    }
+
+    if (size) *size = received;
+    return data;
+}
+
+// The server writes the entry, so `output` is resolved on its side
+bool CAClientExtract(CAClient *client, Path archive, String name, Path output)
+{
+    UInt64 length;
+    if (!CAClientRequest(client, kCARequestExtract, archive, name, output, 0, 0, &length)) return false;
+
+    if (length)
+    {
+        fprintf(stderr, "Error: Unexpected answer from the server\n");
+        client->status = kCAStatusLost;
+        return false;
+    }
+
+    return true;
+}
+
+void CAClientDisconnect(CAClient *client)
+{
+    close(client->fd);
+    free(client);
+}
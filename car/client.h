@@ -0,0 +1,23 @@
+#ifndef __CAR_CLIENT__
+#define __CAR_CLIENT__ 1
+
+#include "server.h"
+
+// One connection to a CAServer. Calls return false (or NULL) on any failure;
+// CAClientStatus then tells a kCAStatus answer from a lost connection, after
+// which every call fails. Calls on one client must not overlap.
+typedef struct CAClient CAClient;
+
+extern CAClient *CAClientConnect(Path socket);
+extern UInt32 CAClientStatus(CAClient *client);
+extern String *CAClientList(CAClient *client, Path archive, Size *count);
+extern bool CAClientStat(CAClient *client, Path archive, String name, CAServerEntryStat *stat);
+extern MemoryAddress CAClientRead(CAClient *client, Path archive, String name, UInt64 offset, UInt64 length, Size *size);
+extern bool CAClientExtract(CAClient *client, Path archive, String name, Path output);
+extern void CAClientDisconnect(CAClient *client);
+
+// CAClientConnect --> Call CAClientDisconnect
+// CAClientList    --> Call free (once, on the returned array)
+// CAClientRead    --> Call free
+
+#endif /* !defined(__CAR_CLIENT__) */
@@ -0,0 +1,459 @@
+#include "iobatch.h"
+
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define OSX_HAVE_IO_URING 1
+    #endif
+#endif
+
+#if defined(OSX_HAVE_IO_URING)
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sched.h>
+
+#define kOSXBatchDirectory 0
+#define kOSXBatchFile      1
+#define kOSXBatchSymlink   2
+
+// Which operation of a job a completion belongs to
+#define kOSXBatchStepCreate 0
+#define kOSXBatchStepWrite  1
+#define kOSXBatchStepClose  2
+
+typedef struct {
+    UInt8 kind;
+    int directory;
+    String name;
+    MemoryAddress data;
+    Size size;
+    UInt32 slot;
+    UInt32 first;   // The job's submissions, from the start of the batch
+    UInt32 steps;
+} OSXBatchJob;
+
+// `fd` is -1 once the ring has been dropped, and every job then runs synchronously
+struct OSXBatch {
+    int fd;
+    UInt32 depth;
+    bool success;
+
+    MemoryAddress sqmap, cqmap;
+    Size sqmapSize, cqmapSize;
+    struct io_uring_sqe *sqes;
+    Size sqesSize;
+
+    UInt32 *sqHead, *sqTail, *sqMask, *sqArray;
+    UInt32 *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    OSXBatchJob *jobs;
+    UInt32 jobCount;
+    UInt32 fileCount;
+    UInt32 sqeCount;
+};
+
+static int OSXBatchSetup(UInt32 entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int OSXBatchEnter(int fd, UInt32 submit, UInt32 wait)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int OSXBatchRegister(int fd, UInt32 opcode, MemoryAddress argument, UInt32 count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, argument, count);
+}
+
+static bool OSXBatchSupported(int fd)
+{
+    Size size = sizeof(struct io_uring_probe) + (IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = calloc(1, size);
+
+    if (OSXBatchRegister(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST))
+    {
+        free(probe);
+        return false;
+    }
+
+    UInt8 needed[] = { IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_MKDIRAT, IORING_OP_SYMLINKAT };
+    bool supported = true;
+
+    for (Size i = 0; i < sizeof(needed); i++)
+    {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = false;
+    }
+
+    free(probe);
+    return supported;
+}
+
+OSXBatch *OSXBatchCreate(UInt32 depth)
+{
+    if (!depth) depth = kOSXBatchDepth;
+
+    // A file takes three submissions (open, write and close)
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+
+    int fd = OSXBatchSetup(depth * 3, &params);
+    if (fd < 0) return NULL;
+
+    if (!OSXBatchSupported(fd))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // Files are opened straight into registered slots so the write and close can be linked to the
+    // open. Such slots are never inherited, and the kernel rejects O_CLOEXEC on them.
+    int *slots = malloc(depth * sizeof(int));
+    for (UInt32 i = 0; i < depth; i++) slots[i] = -1;
+
+    int registered = OSXBatchRegister(fd, IORING_REGISTER_FILES, slots, depth);
+    free(slots);
+
+    if (registered)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    OSXBatch *batch = calloc(1, sizeof(OSXBatch));
+    batch->fd = fd;
+    batch->depth = depth;
+    batch->success = true;
+
+    batch->sqmapSize = params.sq_off.array + (params.sq_entries * sizeof(UInt32));
+    batch->cqmapSize = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    batch->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (batch->cqmapSize > batch->sqmapSize) batch->sqmapSize = batch->cqmapSize;
+        batch->cqmapSize = 0;
+    }
+
+    batch->sqmap = mmap(NULL, batch->sqmapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    batch->cqmap = batch->cqmapSize ? mmap(NULL, batch->cqmapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING) : batch->sqmap;
+    batch->sqes = mmap(NULL, batch->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (batch->sqmap == MAP_FAILED || batch->cqmap == MAP_FAILED || batch->sqes == MAP_FAILED)
+    {
+        if (batch->sqmap != MAP_FAILED) munmap(batch->sqmap, batch->sqmapSize);
+        if (batch->cqmapSize && batch->cqmap != MAP_FAILED) munmap(batch->cqmap, batch->cqmapSize);
+        if (batch->sqes != MAP_FAILED) munmap(batch->sqes, batch->sqesSize);
+
+        close(fd);
+        free(batch);
+        return NULL;
+    }
+
+    batch->sqHead  = batch->sqmap + params.sq_off.head;
+    batch->sqTail  = batch->sqmap + params.sq_off.tail;
+    batch->sqMask  = batch->sqmap + params.sq_off.ring_mask;
+    batch->sqArray = batch->sqmap + params.sq_off.array;
+    batch->cqHead  = batch->cqmap + params.cq_off.head;
+    batch->cqTail  = batch->cqmap + params.cq_off.tail;
+    batch->cqMask  = batch->cqmap + params.cq_off.ring_mask;
+    batch->cqes    = batch->cqmap + params.cq_off.cqes;
+
+    batch->jobs = malloc(depth * sizeof(OSXBatchJob));
+    return batch;
+}
+
+static struct io_uring_sqe *OSXBatchNextSubmission(OSXBatch *batch, UInt8 opcode, UInt32 job, UInt8 step)
+{
+    UInt32 tail = *batch->sqTail + batch->sqeCount++;
+    UInt32 index = tail & *batch->sqMask;
+
+    struct io_uring_sqe *sqe = &batch->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = ((UInt64)job << 2) | step;
+
+    batch->sqArray[index] = index;
+    return sqe;
+}
+
+static bool OSXBatchRun(OSXBatchJob *job)
+{
+    switch (job->kind)
+    {
+        case kOSXBatchDirectory: return OSXCreateDirectoryIn(job->directory, job->name);
+        case kOSXBatchSymlink:   return OSXCreateSymlinkIn(job->directory, job->data, job->name);
+        default:                 return OSXWriteDataToFileIn(job->directory, job->name, job->data, job->size);
+    }
+}
+
+static bool OSXBatchQueue(OSXBatch *batch, UInt8 kind, int directory, String name, MemoryAddress data, Size size)
+{
+    bool success = true;
+    if (batch->jobCount == batch->depth) success = OSXBatchFlush(batch);
+
+    OSXBatchJob unqueued = { .kind = kind, .directory = directory, .name = name, .data = data, .size = size };
+    if (batch->fd < 0) return OSXBatchRun(&unqueued) && success;
+
+    UInt32 index = batch->jobCount++;
+    OSXBatchJob *job = &batch->jobs[index];
+    *job = unqueued;
+    job->first = batch->sqeCount;
+
+    struct io_uring_sqe *sqe;
+
+    switch (kind)
+    {
+        case kOSXBatchDirectory: {
+            sqe = OSXBatchNextSubmission(batch, IORING_OP_MKDIRAT, index, kOSXBatchStepCreate);
+            sqe->fd = directory;
+            sqe->addr = (uintptr_t)name;
+            sqe->len = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        } break;
+        case kOSXBatchSymlink: {
+            sqe = OSXBatchNextSubmission(batch, IORING_OP_SYMLINKAT, index, kOSXBatchStepCreate);
+            sqe->fd = directory;
+            sqe->addr = (uintptr_t)data;
+            sqe->addr2 = (uintptr_t)name;
+        } break;
+        case kOSXBatchFile: {
+            job->slot = batch->fileCount++;
+
+            sqe = OSXBatchNextSubmission(batch, IORING_OP_OPENAT, index, kOSXBatchStepCreate);
+            sqe->fd = directory;
+            sqe->addr = (uintptr_t)name;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+            sqe->len = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+            sqe->file_index = job->slot + 1;
+            sqe->flags = IOSQE_IO_LINK;
+
+            if (size)
+            {
+                sqe = OSXBatchNextSubmission(batch, IORING_OP_WRITE, index, kOSXBatchStepWrite);
+                sqe->fd = job->slot;
+                sqe->addr = (uintptr_t)data;
+                sqe->len = (UInt32)size;
+                sqe->off = 0;
+
+                // Close the slot even if the write fails
+                sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            }
+
+            sqe = OSXBatchNextSubmission(batch, IORING_OP_CLOSE, index, kOSXBatchStepClose);
+            sqe->file_index = job->slot + 1;
+        } break;
+    }
+
+    job->steps = batch->sqeCount - job->first;
+    return success;
+}
+
+bool OSXBatchCreateDirectory(OSXBatch *batch, int directory, String name)
+{
+    return OSXBatchQueue(batch, kOSXBatchDirectory, directory, name, NULL, 0);
+}
+
+bool OSXBatchWriteFile(OSXBatch *batch, int directory, String name, MemoryAddress data, Size size)
+{
+    if (size > kOSXBatchMaxWrite) return OSXWriteDataToFileIn(directory, name, data, size);
+    return OSXBatchQueue(batch, kOSXBatchFile, directory, name, data, size);
+}
+
+bool OSXBatchCreateSymlink(OSXBatch *batch, int directory, String from, String name)
+{
+    return OSXBatchQueue(batch, kOSXBatchSymlink, directory, name, from, 0);
+}
+
+static void OSXBatchReportError(String call, int result)
+{
+    fprintf(stderr, "%s: %s\n", call, strerror(-result));
+}
+
+static bool OSXBatchComplete(OSXBatch *batch, OSXBatchJob *job, UInt8 step, int result)
+{
+    // Whatever failed earlier in the chain has been reported already
+    if (result == -ECANCELED) return false;
+
+    switch (step)
+    {
+        case kOSXBatchStepCreate: {
+            if (result >= 0) return true;
+
+            if (job->kind == kOSXBatchDirectory) {
+                if (result == -EEXIST) return true;
+
+                fprintf(stderr, "Error: Could not create directory '%s'\n", job->name);
+                OSXBatchReportError("mkdir", result);
+            } else if (job->kind == kOSXBatchSymlink) {
+                if (result == -EEXIST)
+                {
+                    fprintf(stderr, "Warning: file '%s' already exists. Will ignore\n", job->name);
+                    return true;
+                }
+
+                fprintf(stderr, "Error: Could not create a symlink from '%s' to '%s'\n", (String)job->data, job->name);
+                OSXBatchReportError("symlink", result);
+            } else {
+                fprintf(stderr, "Error: Could not open file '%s'\n", job->name);
+                OSXBatchReportError("open", result);
+            }
+        } break;
+        case kOSXBatchStepWrite: {
+            if ((Size)result == job->size) return true;
+
+            fprintf(stderr, "Error: Could not write %lu bytes of data at 0x%016lX to file '%s'\n", job->size, (uintptr_t)job->data, job->name);
+            OSXBatchReportError("write", (result < 0) ? result : -EIO);
+        } break;
+        case kOSXBatchStepClose: {
+            if (result >= 0) return true;
+
+            fprintf(stderr, "Error: Could not close file '%s'\n", job->name);
+            OSXBatchReportError("close", result);
+        } break;
+    }
+
+    return false;
+}
+
+// Unmaps and closes the ring. Closing it releases any slot still holding a file.
+static void OSXBatchDrop(OSXBatch *batch)
+{
+    munmap(batch->sqes, batch->sqesSize);
+    if (batch->cqmapSize) munmap(batch->cqmap, batch->cqmapSize);
+    munmap(batch->sqmap, batch->sqmapSize);
+
+    close(batch->fd);
+    batch->fd = -1;
+}
+
+bool OSXBatchFlush(OSXBatch *batch)
+{
+    if (batch->fd < 0) return true;
+
+    UInt32 expected = batch->sqeCount;
+    UInt32 submitted = 0;
+    UInt32 reaped = 0;
+    bool failed = false;
+
+    __atomic_store_n(batch->sqTail, *batch->sqTail + batch->sqeCount, __ATOMIC_RELEASE);
+
+    while (reaped < expected)
+    {
+        int result = OSXBatchEnter(batch->fd, (failed ? 0 : expected - submitted), 1);
+
+        if (result >= 0) {
+            submitted += result;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (!failed)
+            {
+                fprintf(stderr, "Warning: Could not submit %u queued operations. Will write them directly\n", expected - submitted);
+                perror("io_uring_enter");
+
+                // The kernel still completes what it took (and reads the jobs for
+                // it), so wait for exactly that much and submit nothing more
+                failed = true;
+                expected = submitted;
+                continue;
+            }
+
+            // Not even waiting works, but the completions still arrive
+            sched_yield();
+        }
+
+        UInt32 head = *batch->cqHead;
+        UInt32 tail = __atomic_load_n(batch->cqTail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++, reaped++)
+        {
+            struct io_uring_cqe *cqe = &batch->cqes[head & *batch->cqMask];
+            OSXBatchJob *job = &batch->jobs[cqe->user_data >> 2];
+
+            // A job cut short by a failed submission runs again below
+            if (failed && job->first + job->steps > submitted) continue;
+
+            if (!OSXBatchComplete(batch, job, cqe->user_data & 3, cqe->res))
+                batch->success = false;
+        }
+
+        __atomic_store_n(batch->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (failed)
+    {
+        // The rest of the ring was published and can never be taken back, so
+        // the ring goes and everything the kernel didn't take runs here
+        OSXBatchDrop(batch);
+
+        for (UInt32 i = 0; i < batch->jobCount; i++)
+        {
+            OSXBatchJob *job = &batch->jobs[i];
+            if (job->first + job->steps > submitted && !OSXBatchRun(job)) batch->success = false;
+        }
+    }
+
+    batch->jobCount = 0;
+    batch->fileCount = 0;
+    batch->sqeCount = 0;
+
+    bool success = batch->success;
+    batch->success = true;
+    return success;
+}
+
+bool OSXBatchDestroy(OSXBatch *batch)
+{
+    bool success = OSXBatchFlush(batch);
+    if (batch->fd >= 0) OSXBatchDrop(batch);
+
+    free(batch->jobs);
+    free(batch);
+
+    return success;
+}
+
+#else /* !defined(OSX_HAVE_IO_URING) */
+
+struct OSXBatch {
+    UInt32 depth;
+};
+
+OSXBatch *OSXBatchCreate(UInt32 depth)
+{
+    (void)depth;
+    return NULL;
+}
+
+bool OSXBatchCreateDirectory(OSXBatch *batch, int directory, String name)
+{
+    (void)batch;
+    return OSXCreateDirectoryIn(directory, name);
+}
+
+bool OSXBatchWriteFile(OSXBatch *batch, int directory, String name, MemoryAddress data, Size size)
+{
+    (void)batch;
+    return OSXWriteDataToFileIn(directory, name, data, size);
+}
+
+bool OSXBatchCreateSymlink(OSXBatch *batch, int directory, String from, String name)
+{
+    (void)batch;
+    return OSXCreateSymlinkIn(directory, from, name);
+}
+
+bool OSXBatchFlush(OSXBatch *batch)
+{
+    (void)batch;
+    return true;
+}
+
+bool OSXBatchDestroy(OSXBatch *batch)
+{
+    (void)batch;
+    return true;
+}
+
+#endif /* defined(OSX_HAVE_IO_URING) */
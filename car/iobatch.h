@@ -0,0 +1,39 @@
+#ifndef __CAR_IOBATCH__
+#define __CAR_IOBATCH__ 1
+
+#include "syscalls.h"
+
+// Default number of queued operations per submission
+#define kOSXBatchDepth    256
+
+// Files larger than this are left to the synchronous path, as a single
+// write in a linked chain must not come up short.
+#define kOSXBatchMaxWrite (1 << 20)
+
+// Batches directory, file and symlink creation into as few system calls as
+// possible. On Linux this is backed by io_uring (through the raw system
+// calls); everywhere else, or when the running kernel lacks the needed
+// operations, OSXBatchCreate returns NULL and callers should fall back to
+// the synchronous helpers in syscalls.h.
+//
+// The rest of the tree is built as an Xcode project (blocks, Foundation),
+// so the io_uring backend, like the other Linux-only paths in syscalls.c,
+// is not built or tested in-tree; building car for Linux needs clang with
+// -fblocks and a blocks runtime, and main.m needs a Foundation port.
+//
+// Every operation names a single component inside an open directory, as
+// with the *In helpers. Queued operations run in no particular order, so a
+// directory has to be flushed before anything is queued inside it. Names,
+// data and directory handles must stay valid until the next flush.
+typedef struct OSXBatch OSXBatch;
+
+extern OSXBatch *OSXBatchCreate(UInt32 depth);
+extern bool OSXBatchCreateDirectory(OSXBatch *batch, int directory, String name);
+extern bool OSXBatchWriteFile(OSXBatch *batch, int directory, String name, MemoryAddress data, Size size);
+extern bool OSXBatchCreateSymlink(OSXBatch *batch, int directory, String from, String name);
+extern bool OSXBatchFlush(OSXBatch *batch);
+extern bool OSXBatchDestroy(OSXBatch *batch);
+
+// OSXBatchCreate --> Call OSXBatchDestroy
+
+#endif /* !defined(__CAR_IOBATCH__) */
@@ -7,12 +7,39 @@ FileListLinked *FileListLinkedCreate(void)
     FileListLinked *list = malloc(sizeof(FileListLinked));
     memset(&list->data, 0, sizeof(FileListData));
     list->head = list->tail = NULL;
+    list->sparse = false;
+    list->scanned = NULL;
+    list->userinfo = NULL;
     return list;
 }
 
+// Only worth storing as a sparse entry if the extent map and data are smaller than the file
+static bool FileListLinkedAddSparseFile(FileListLinked *list, Path path, FileStats *stats)
+{
+    if ((stats->st_blocks * 512) >= stats->st_size) return false;
+
+    UInt64 *extents, count;
+    if (!OSXReadFileExtents(path, stats->st_size, &extents, &count)) return false;
+
+    Size size = (2 + (2 * count)) * sizeof(UInt64);
+    for (UInt64 i = 0; i < count; i++) size += extents[(2 * i) + 1];
+
+    if (size >= (Size)stats->st_size)
+    {
+        free(extents);
+        return false;
+    }
+
+    FileListLinkedAddFile(list, path, kEntryTypeSparse, size);
+    list->tail->extents = extents;
+    list->tail->extentCount = count;
+    list->tail->logicalSize = stats->st_size;
+    return true;
+}
+
 bool FileListLinkedAddDirectory(FileListLinked *list, Path directory)
 {
-    printf("L %s\n", directory);
+    if (list->scanned) list->scanned(directory, list->userinfo);
 
     if (!OSXHaveSearchAccess(directory))
     {
@@ -21,11 +48,11 @@ bool FileListLinkedAddDirectory(FileListLinked *list, Path directory)
     }
 
     return OSXRunBlockOnDirectoryContents(directory, (bool (^)(Path, DirectoryEntry, MemoryAddress))^(Path directory, DirectoryEntry entry, FileListLinked *list) {
-        if (entry->d_namlen == 2 && *((UInt16 *)entry->d_name) == 0x2E2E) return true; // '..'
+        if (!strcmp(entry->d_name, "..")) return true;
 
-        if (entry->d_namlen == 1 && entry->d_name[0] == '.') // '.'
+        if (!strcmp(entry->d_name, "."))
         {
-            FileListLinkedAddFile(list, directory, kEntryTypeDirectory, 0);
+            FileListLinkedAddFile(list, strdup(directory), kEntryTypeDirectory, 0);
             return true;
         }
 
@@ -33,10 +60,11 @@ bool FileListLinkedAddDirectory(FileListLinked *list, Path directory)
         FileStats *stats = OSXReadFileStats(realpath, false);
 
         if (!OSXIsDirectory(stats)) {
-            printf("L %s\n", realpath);
+            if (list->scanned) list->scanned(realpath, list->userinfo);
 
             if (OSXIsRegular(stats)) {
-                FileListLinkedAddFile(list, realpath, kEntryTypeRegular, stats->st_size);
+                if (!list->sparse || !FileListLinkedAddSparseFile(list, realpath, stats))
+                    FileListLinkedAddFile(list, realpath, kEntryTypeRegular, stats->st_size);
             } else if (OSXIsLink(stats)) {
                 Size linksize = -1;
                 String link = OSXReadLink(realpath, &linksize);
@@ -52,9 +80,14 @@ bool FileListLinkedAddDirectory(FileListLinked *list, Path directory)
             } else {
                 fprintf(stderr, "Warning: Item at '%s' is of unknown type\n", realpath);
                 free(realpath);
+                free(stats);
+                return true;
             }
+
+            list->tail->location = stats->st_ino;
         } else {
             bool success = FileListLinkedAddDirectory(list, realpath);
+            free(realpath);
 
             if (!success)
             {
@@ -94,15 +127,17 @@ void FileListLinkedAddFile(FileListLinked *list, Path path, UInt8 type, Size siz
 
 extern void FileListLinkedDestory(FileListLinked *list)
 {
-    FileListEntry *entry = list->head->next;
-    free(entry->prev);
+    FileListEntry *entry = list->head;
 
     while (entry)
     {
+        FileListEntry *next = entry->next;
+
+        free(entry->extents);
         free(entry->path);
         free(entry);
 
-        entry = entry->next;
+        entry = next;
     }
 
     free(list);
@@ -118,7 +153,60 @@ FileListArray *FileListArrayCreate(void)
     return list;
 }
 
-extern void FileListArraySort(FileListArray *list);
+typedef struct {
+    FileListEntry *entry;
+    UInt64 index;
+} FileListOrderEntry;
+
+// Located entries first, by position on disk, then the rest by inode
+static int FileListCompareLocations(const void *a, const void *b)
+{
+    const FileListOrderEntry *left = a, *right = b;
+
+    if (left->entry->located != right->entry->located) return left->entry->located ? -1 : 1;
+    if (left->entry->location != right->entry->location) return (left->entry->location < right->entry->location) ? -1 : 1;
+    return (left->index > right->index) - (left->index < right->index);
+}
+
+// Fills `order` with the list's indices in the order their data is quickest
+// to read: by where it starts on disk wherever the filesystem says, and by
+// inode number (which tends to follow allocation) everywhere else, with ties
+// kept in list order. The lookups go in inode order too, so reading the
+// inodes for them is close to sequential as well. The list stays as it is.
+void FileListArraySort(FileListArray *list, UInt64 *order)
+{
+    Size count = list->data.listsize;
+    FileListOrderEntry *sorted = malloc(count * sizeof(FileListOrderEntry));
+
+    for (Size i = 0; i < count; i++)
+    {
+        sorted[i].entry = list->entries[i];
+        sorted[i].index = i;
+    }
+
+    qsort(sorted, count, sizeof(FileListOrderEntry), FileListCompareLocations);
+
+    for (Size i = 0; i < count; i++)
+    {
+        FileListEntry *entry = sorted[i].entry;
+        if (entry->type != kEntryTypeRegular && entry->type != kEntryTypeSparse) continue;
+
+        UInt64 location;
+
+        if (entry->size && OSXReadFileLocation(entry->path, &location))
+        {
+            entry->location = location;
+            entry->located = true;
+        }
+    }
+
+    qsort(sorted, count, sizeof(FileListOrderEntry), FileListCompareLocations);
+
+    for (Size i = 0; i < count; i++)
+        order[i] = sorted[i].index;
+
+    free(sorted);
+}
 
 void FileListArrayDestroy(FileListArray *list)
 {
@@ -8,6 +8,7 @@
 #define kEntryTypeRegular   0
 #define kEntryTypeDirectory 1
 #define kEntryTypeSymlink   2
+#define kEntryTypeSparse    3
 
 typedef struct FileListEntry {
     struct FileListEntry *next, *prev;
@@ -15,6 +16,15 @@ typedef struct FileListEntry {
     Path path;
     UInt8 type;
     Size size;
+
+    // Sparse files only: (offset, length) pairs of the data extents
+    UInt64 *extents;
+    UInt64 extentCount;
+    Size logicalSize;
+
+    // The inode number, or where the data starts on disk once FileListArraySort has found it
+    UInt64 location;
+    bool located;
 } FileListEntry;
 
 typedef struct {
@@ -28,6 +38,11 @@ typedef struct {
 typedef struct {
     FileListEntry *head, *tail;
     FileListData data;
+    bool sparse; // Detect sparse files while scanning
+
+    // Called with every path found while scanning, if set
+    void (^scanned)(Path path, MemoryAddress userinfo);
+    MemoryAddress userinfo;
 } FileListLinked;
 
 extern FileListLinked *FileListLinkedCreate(void);
@@ -43,7 +58,7 @@ typedef struct {
 } FileListArray;
 
 extern FileListArray *FileListArrayCreate(void);
-extern void FileListArraySort(FileListArray *list);
+extern void FileListArraySort(FileListArray *list, UInt64 *order);
 extern void FileListArrayDestroy(FileListArray *list);
 
 #pragma mark - Conversion
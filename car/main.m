@@ -1,20 +1,131 @@
 #import <Foundation/Foundation.h>
 #include "archive.h"
+#include "server.h"
 
 #define CFLAG_V @"-v"
 #define CFLAG_C @"-c"
 #define CFLAG_X @"-x"
 #define CFLAG_L @"-l"
 #define CFLAG_I @"-i"
+#define CFLAG_K @"-k"
+#define CFLAG_5 @"-5"
+#define CFLAG_N @"-n"
+#define CFLAG_M @"-m"
+#define CFLAG_S @"-S"
+#define CFLAG_R @"-r"
+#define CFLAG_P @"-p"
+#define CFLAG_E @"-e"
+#define CFLAG_D @"-d"
+#define CFLAG_A @"-a"
+#define CFLAG_J @"-j"
+#define CFLAG_O @"-o"
+#define CFLAG_PROGRESS @"-P"
+#define CFLAG_SERVE @"-D"
+
+// Redraw the progress line at most this often (in nanoseconds)
+#define kCLIProgressInterval 100000000ULL
 
 static int stdout_dup = -1;
 
+typedef struct {
+    OSXOutputBuffer *output;    // Every entry, with -v
+    char finished;              // What a finished entry is listed as
+    int progress;               // Where the progress line goes, -1 for none
+    UInt64 lastUpdate;
+    bool drawn;
+} CLIReporter;
+
+static UInt64 CLINow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((UInt64)now.tv_sec * 1000000000ULL) + (UInt64)now.tv_nsec;
+}
+
+static void CLIDrawProgress(CLIReporter *reporter, CAArchiveEvent *event)
+{
+    char line[128];
+    int length;
+
+    if (event->bytesTotal) {
+        length = snprintf(line, sizeof(line), "\r%llu/%llu entries, %llu/%llu MB", (unsigned long long)event->entriesDone, (unsigned long long)event->entriesTotal, (unsigned long long)(event->bytesDone >> 20), (unsigned long long)(event->bytesTotal >> 20));
+    } else {
+        length = snprintf(line, sizeof(line), "\r%llu entries", (unsigned long long)event->entriesDone);
+    }
+
+    // Progress is best effort, so a failed write just stops it
+    if (length > 0 && write(reporter->progress, line, MIN((Size)length, sizeof(line) - 1)) < 0)
+    {
+        reporter->progress = -1;
+        return;
+    }
+
+    reporter->drawn = true;
+}
+
+// Entries are listed through one buffer instead of a write per line, and
+// the progress line is only redrawn every kCLIProgressInterval
+static void CLIReport(CLIReporter *reporter, CAArchiveEvent *event)
+{
+    if (reporter->output)
+    {
+        char prefix = 0;
+
+        if (event->type == kCAEventScanned) prefix = 'L';
+        else if (event->type == kCAEventFinished) prefix = reporter->finished;
+        else if (event->type == kCAEventFailed) prefix = 'F';
+
+        if (prefix)
+        {
+            char start[2] = { prefix, ' ' };
+
+            OSXOutputBufferAppend(reporter->output, start, sizeof(start));
+            OSXOutputBufferAppend(reporter->output, event->name, strlen(event->name));
+            OSXOutputBufferAppend(reporter->output, "\n", 1);
+        }
+    }
+
+    if (reporter->progress != -1 && event->type != kCAEventStarted)
+    {
+        UInt64 now = CLINow();
+
+        if (now - reporter->lastUpdate >= kCLIProgressInterval || event->entriesDone == event->entriesTotal)
+        {
+            CLIDrawProgress(reporter, event);
+            reporter->lastUpdate = now;
+        }
+    }
+}
+
+// NULL if there is nothing to report
+static CLIReporter *CLIReporterCreate(bool verbose, bool progress, char finished)
+{
+    if (!verbose && !progress) return NULL;
+
+    CLIReporter *reporter = calloc(1, sizeof(CLIReporter));
+    reporter->output = verbose ? OSXOutputBufferCreate(STDOUT_FILENO) : NULL;
+    reporter->finished = finished;
+
+    // Progress goes to the terminal, out of the way of the listing
+    reporter->progress = progress ? (verbose ? STDERR_FILENO : stdout_dup) : -1;
+    return reporter;
+}
+
+static void CLIReporterDestroy(CLIReporter *reporter)
+{
+    if (!reporter) return;
+    if (reporter->output) OSXOutputBufferDestroy(reporter->output);
+    if (reporter->drawn && reporter->progress != -1 && write(reporter->progress, "\n", 1) < 0) perror("write");
+
+    free(reporter);
+}
+
 __attribute__((noreturn)) static void usage(NSString *name)
 {
     // Restore Redirected Stream
     if (stdout_dup != -1) dup2(stdout_dup, STDOUT_FILENO);
     
-    printf("Usage: %s -[c:x:l:i] [-v] <Options>\n", [name UTF8String]);
+    printf("Usage: %s -[c:j:x:l:i:d:D] [-v] [-P] [-k] [-S] [-5 [-n] [-e] [-p shards] [-a crc32|crc32c|xxh64]] [-o first|last|fail] [-r bytes] <Options>\n", [name UTF8String]);
     exit(EXIT_FAILURE);
 }
 
@@ -26,7 +137,11 @@ int main(int argc, const char *const *argv)
         for (int i = 0; i < argc; i++) [args addObject:[NSString stringWithUTF8String:argv[i]]];
         NSString *name = args[0]; [args removeObjectAtIndex:0];
 
-        if (![args containsObject:CFLAG_V]) {
+        bool verbose = [args containsObject:CFLAG_V];
+        bool progress = [args containsObject:CFLAG_PROGRESS];
+        [args removeObject:CFLAG_PROGRESS];
+
+        if (!verbose) {
             // Redirect stdout to /dev/null
             stdout_dup = dup(STDOUT_FILENO);
 
@@ -36,14 +151,129 @@ int main(int argc, const char *const *argv)
         } else {
             [args removeObject:CFLAG_V];
         }
+
+        CAArchiveEventBlock events = ^(CAArchiveEvent *event, MemoryAddress userinfo) {
+            CLIReport(userinfo, event);
+        };
         
-        if ([args containsObject:CFLAG_C]) {
+        if ([args containsObject:CFLAG_C] || [args containsObject:CFLAG_J]) {
+            CAArchiveOptions options = { .version = 4, .chunkShift = 0, .hierarchicalNames = false, .sparseFiles = false, .shards = 0, .entryChecksums = false, .checksumType = kCAChecksumCRC32 };
+            NSUInteger index = [args indexOfObject:CFLAG_P];
+
+            if (index != NSNotFound)
+            {
+                if (index + 1 >= [args count]) usage(name);
+
+                options.shards = (UInt32)strtoul([args[index + 1] UTF8String], NULL, 0);
+                [args removeObjectsInRange:NSMakeRange(index, 2)];
+            }
+
+            index = [args indexOfObject:CFLAG_A];
+
+            if (index != NSNotFound)
+            {
+                if (index + 1 >= [args count]) usage(name);
+                NSString *algorithm = [args[index + 1] lowercaseString];
+
+                if ([algorithm isEqualToString:@"crc32"]) {
+                    options.checksumType = kCAChecksumCRC32;
+                } else if ([algorithm isEqualToString:@"crc32c"]) {
+                    options.checksumType = kCAChecksumCRC32C;
+                } else if ([algorithm isEqualToString:@"xxh64"]) {
+                    options.checksumType = kCAChecksumXXH64;
+                } else {
+                    usage(name);
+                }
+
+                [args removeObjectsInRange:NSMakeRange(index, 2)];
+            }
+
+            if ([args containsObject:CFLAG_S])
+            {
+                options.sparseFiles = true;
+                [args removeObject:CFLAG_S];
+            }
+
+            if ([args containsObject:CFLAG_5])
+            {
+                options.version = 5;
+                [args removeObject:CFLAG_5];
+            }
+
+            if ([args containsObject:CFLAG_N])
+            {
+                options.hierarchicalNames = true;
+                [args removeObject:CFLAG_N];
+            }
+
+            if ([args containsObject:CFLAG_K])
+            {
+                options.chunkShift = kCAChunkShiftDefault;
+                [args removeObject:CFLAG_K];
+            }
+
+            if ([args containsObject:CFLAG_E])
+            {
+                options.entryChecksums = true;
+                [args removeObject:CFLAG_E];
+            }
+
+            CLIReporter *reporter = CLIReporterCreate(verbose, progress, 'A');
+            options.events = reporter ? events : NULL;
+            options.userinfo = reporter;
+
+            if ([args containsObject:CFLAG_J])
+            {
+                UInt8 policy = kCAMergeFail;
+                index = [args indexOfObject:CFLAG_O];
+
+                if (index != NSNotFound)
+                {
+                    if (index + 1 >= [args count]) usage(name);
+                    NSString *choice = [args[index + 1] lowercaseString];
+
+                    if ([choice isEqualToString:@"first"]) {
+                        policy = kCAMergeKeepFirst;
+                    } else if ([choice isEqualToString:@"last"]) {
+                        policy = kCAMergeKeepLast;
+                    } else if (![choice isEqualToString:@"fail"]) {
+                        usage(name);
+                    }
+
+                    [args removeObjectsInRange:NSMakeRange(index, 2)];
+                }
+
+                [args removeObject:CFLAG_J];
+                if ([args count] < 2) usage(name);
+
+                // Every input is archive[=prefix]
+                Size count = [args count] - 1;
+                CAArchiveMergeInput *inputs = malloc(count * sizeof(CAArchiveMergeInput));
+
+                for (Size i = 0; i < count; i++)
+                {
+                    NSString *input = args[i + 1];
+                    NSRange separator = [input rangeOfString:@"=" options:NSBackwardsSearch];
+
+                    inputs[i].archive = (char *)[(separator.location == NSNotFound ? input : [input substringToIndex:separator.location]) UTF8String];
+                    inputs[i].prefix = (char *)(separator.location == NSNotFound ? "" : [[input substringFromIndex:separator.location + 1] UTF8String]);
+                }
+
+                bool merged = CAArchiveMerge((char *)[args[0] UTF8String], inputs, count, policy, &options);
+                CLIReporterDestroy(reporter);
+                free(inputs);
+
+                printf((merged ? "J %s\n" : "F %s\n"), [args[0] UTF8String]);
+                exit(merged);
+            }
+
             if ([args count] != 3) usage(name);
             [args removeObject:CFLAG_C];
             NSString *archive = args[0];
             NSString *rootdir = args[1];
 
-            bool created = CAArchiveCreate((char *)[archive UTF8String], (char *)[rootdir UTF8String]);
+            bool created = CAArchiveCreate((char *)[archive UTF8String], (char *)[rootdir UTF8String], &options);
+            CLIReporterDestroy(reporter);
             printf((created ? "C %s\n" : "F %s\n"), [archive UTF8String]);
             exit(created);
         } else if ([args containsObject:CFLAG_L]) {
@@ -52,25 +282,111 @@ int main(int argc, const char *const *argv)
             NSString *archive = args[0];
 
             if (stdout_dup != -1) dup2(stdout_dup, STDOUT_FILENO);
-            CAArchiveListContents((char *)[archive UTF8String], NULL);
+            if (!CAArchiveWriteContents((char *)[archive UTF8String], STDOUT_FILENO)) exit(EXIT_FAILURE);
         } else if ([args containsObject:CFLAG_X]) {
             [args removeObject:CFLAG_X];
-            
-            if ([args count] == 2) {
-                bool success = CAArchiveExtractAll((char *)[args[0] UTF8String], (char *)[args[1] UTF8String]);
+
+            CLIReporter *reporter = CLIReporterCreate(verbose, progress, 'X');
+            CAArchiveExtractOptions options = { .readahead = kCAReadaheadDefault, .events = reporter ? events : NULL, .userinfo = reporter };
+            NSUInteger index = [args indexOfObject:CFLAG_R];
+
+            if (index != NSNotFound)
+            {
+                if (index + 1 >= [args count]) usage(name);
+
+                options.readahead = strtoull([args[index + 1] UTF8String], NULL, 0);
+                [args removeObjectsInRange:NSMakeRange(index, 2)];
+            }
+
+            if ([args containsObject:CFLAG_M]) {
+                [args removeObject:CFLAG_M];
+                if ([args count] < 3) usage(name);
+
+                // Everything after the archive and output directory is a prefix or glob
+                Size count = [args count] - 2;
+                String *patterns = malloc(count * sizeof(String));
+
+                for (Size i = 0; i < count; i++)
+                    patterns[i] = (String)[args[i + 2] UTF8String];
+
+                bool success = CAArchiveExtractMatching((char *)[args[0] UTF8String], patterns, count, (char *)[args[1] UTF8String], &options);
+                CLIReporterDestroy(reporter);
+                printf((success ? "X %s\n" : "F %s\n"), [args[0] UTF8String]);
+                free(patterns);
+            } else if ([args count] == 2) {
+                bool success = CAArchiveExtractAll((char *)[args[0] UTF8String], (char *)[args[1] UTF8String], &options);
+                CLIReporterDestroy(reporter);
                 printf((success ? "X %s\n" : "F %s\n"), [args[0] UTF8String]);
             } else if ([args count] == 3) {
-                bool success = CAArchiveExtractItem((char *)[args[0] UTF8String], (char *)[args[1] UTF8String], (char *)[args[2] UTF8String]);
+                bool success = CAArchiveExtractItem((char *)[args[0] UTF8String], (char *)[args[1] UTF8String], (char *)[args[2] UTF8String], &options);
+                CLIReporterDestroy(reporter);
                 printf((success ? "X %s\n" : "F %s\n"), [args[0] UTF8String]);
             } else {
                 usage(name);
             }
+        } else if ([args containsObject:CFLAG_D]) {
+            if ([args count] != 3) usage(name);
+            [args removeObject:CFLAG_D];
+
+            // The status lines are the result, so they go to the original stdout even without -v
+            OSXOutputBuffer *output = OSXOutputBufferCreate((stdout_dup != -1) ? stdout_dup : STDOUT_FILENO);
+
+            bool matches = CAArchiveCompare((char *)[args[0] UTF8String], (char *)[args[1] UTF8String], ^(UInt8 status, String entry, MemoryAddress userinfo) {
+                char prefix[2] = { (char)status, ' ' };
+
+                OSXOutputBufferAppend(userinfo, prefix, sizeof(prefix));
+                OSXOutputBufferAppend(userinfo, entry, strlen(entry));
+                OSXOutputBufferAppend(userinfo, "\n", 1);
+            }, output);
+
+            OSXOutputBufferDestroy(output);
+            if (!matches) exit(EXIT_FAILURE);
         } else if ([args containsObject:CFLAG_I]) {
             [args removeObject:CFLAG_I];
-            if ([args count] != 1) usage(name);
+            if ([args count] != 1 && [args count] != 3) usage(name);
 
             if (stdout_dup != -1) dup2(stdout_dup, STDOUT_FILENO);
-            printf("Archive %s is %s\n", [args[0] UTF8String], (CAArchiveCheckValidity((char *)[args[0] UTF8String]) ? "VALID" : "INVALID"));
+
+            if ([args count] == 1) {
+                printf("Archive %s is %s\n", [args[0] UTF8String], (CAArchiveCheckValidity((char *)[args[0] UTF8String]) ? "VALID" : "INVALID"));
+            } else {
+                // Verify a byte range of the data region against its chunk hashes
+                UInt64 offset = strtoull([args[1] UTF8String], NULL, 0);
+                UInt64 length = strtoull([args[2] UTF8String], NULL, 0);
+
+                bool valid = CAArchiveVerifyChunks((char *)[args[0] UTF8String], offset, length, ^(UInt64 chunk, CAArchiveEntryInfo *entry, MemoryAddress userinfo) {
+                    if (chunk == kCAChunkTreeDamaged) {
+                        printf("B tree\n");
+                    } else {
+                        printf("B %llu %s\n", (unsigned long long)chunk, (entry ? entry->name : "-"));
+                    }
+                }, NULL);
+
+                printf("Archive %s is %s\n", [args[0] UTF8String], (valid ? "VALID" : "INVALID"));
+            }
+        } else if ([args containsObject:CFLAG_SERVE]) {
+            [args removeObject:CFLAG_SERVE];
+            if ([args count] < 1) usage(name);
+
+            CAServer *server = CAServerCreate((char *)[args[0] UTF8String]);
+
+            if (!server)
+            {
+                printf("F %s\n", [args[0] UTF8String]);
+                exit(EXIT_FAILURE);
+            }
+
+            // Archives named after the socket are opened ahead of their first request
+            for (NSUInteger i = 1; i < [args count]; i++)
+            {
+                if (!CAServerAddArchive(server, (char *)[args[i] UTF8String]))
+                    fprintf(stderr, "Warning: Could not open archive '%s'\n", [args[i] UTF8String]);
+            }
+
+            CAServerRun(server);
+            CAServerDestroy(server);
+            printf("F %s\n", [args[0] UTF8String]);
+            exit(EXIT_FAILURE);
         } else {
             usage(name);
         }
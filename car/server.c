@@ -0,0 +1,372 @@
+#include "server.h"
+
+// An opened archive. Its archive holds a reference while it is current and
+// each request using it holds another, so one replaced mid-request stays
+// open until the last of them is done.
+typedef struct {
+    CAArchiveHandle *handle;
+    FileStats stats;
+    UInt64 references;
+} CAServerHandle;
+
+// `current` is NULL while the file can't be opened. `users` and `lastUse`
+// belong to the server's lock, everything else (with every reference on
+// `current`) to the archive's.
+typedef struct {
+    Path path;
+    CAServerHandle *current;
+    pthread_mutex_t lock;
+    UInt64 users;
+    UInt64 lastUse;
+} CAServerArchive;
+
+struct CAServer {
+    int listener;
+    Path socket;
+    CAServerArchive **archives;
+    UInt64 archiveCount;
+    UInt64 clock;
+    pthread_mutex_t lock;
+};
+
+typedef struct {
+    CAServer *server;
+    int fd;
+} CAServerConnection;
+
+#pragma mark - Archive Cache
+
+// With the archive's lock held
+static void CAServerHandleRelease(CAServerHandle *opened)
+{
+    if (--opened->references) return;
+
+    CAArchiveHandleClose(opened->handle);
+    free(opened);
+}
+
+static void CAServerArchiveDestroy(CAServerArchive *archive)
+{
+    if (archive->current) CAServerHandleRelease(archive->current);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive->path);
+    free(archive);
+}
+
+// Drops the least recently used archive nobody is using, if there is one
+static bool CAServerEvict(CAServer *server)
+{
+    UInt64 oldest = UINT64_MAX;
+
+    for (UInt64 i = 0; i < server->archiveCount; i++)
+    {
+        if (server->archives[i]->users) continue;
+        if (oldest == UINT64_MAX || server->archives[i]->lastUse < server->archives[oldest]->lastUse) oldest = i;
+    }
+
+    if (oldest == UINT64_MAX) return false;
+
+    CAServerArchiveDestroy(server->archives[oldest]);
+    server->archives[oldest] = server->archives[--server->archiveCount];
+    return true;
+}
+
+#if defined(__APPLE__)
+    #define CAServerModified(stats) ((stats)->st_mtimespec)
+#else
+    #define CAServerModified(stats) ((stats)->st_mtim)
+#endif
+
+static bool CAServerArchiveChanged(FileStats *old, FileStats *new)
+{
+    if (old->st_dev != new->st_dev || old->st_ino != new->st_ino || old->st_size != new->st_size) return true;
+    return CAServerModified(old).tv_sec != CAServerModified(new).tv_sec || CAServerModified(old).tv_nsec != CAServerModified(new).tv_nsec;
+}
+
+// Finds (or adds) an archive and holds it in the cache for one request
+static CAServerArchive *CAServerAcquire(CAServer *server, Path path)
+{
+    CAServerArchive *archive = NULL;
+    pthread_mutex_lock(&server->lock);
+
+    for (UInt64 i = 0; i < server->archiveCount && !archive; i++)
+        if (!strcmp(server->archives[i]->path, path)) archive = server->archives[i];
+
+    if (!archive)
+    {
+        // Only archives nobody is using can go, so this may leave too many
+        while (server->archiveCount >= kCAServerArchivesMax && CAServerEvict(server));
+
+        archive = calloc(1, sizeof(CAServerArchive));
+        archive->path = strdup(path);
+        pthread_mutex_init(&archive->lock, NULL);
+
+        server->archives = realloc(server->archives, (server->archiveCount + 1) * sizeof(CAServerArchive *));
+        server->archives[server->archiveCount++] = archive;
+    }
+
+    archive->users++;
+    archive->lastUse = ++server->clock;
+    pthread_mutex_unlock(&server->lock);
+
+    return archive;
+}
+
+static void CAServerRelease(CAServer *server, CAServerArchive *archive)
+{
+    pthread_mutex_lock(&server->lock);
+    archive->users--;
+    pthread_mutex_unlock(&server->lock);
+}
+
+// With the archive's lock held: its handle, reopened first if the file at its
+// path changed, with a reference taken. NULL if the file can't be opened as
+// an archive.
+static CAServerHandle *CAServerArchiveOpen(CAServerArchive *archive)
+{
+    FileStats stats;
+    bool exists = !stat(archive->path, &stats);
+
+    if (archive->current && (!exists || CAServerArchiveChanged(&archive->current->stats, &stats)))
+    {
+        CAServerHandleRelease(archive->current);
+        archive->current = NULL;
+    }
+
+    if (!archive->current && exists)
+    {
+        CAArchiveHandle *handle = CAArchiveHandleOpen(archive->path);
+
+        if (handle)
+        {
+            archive->current = malloc(sizeof(CAServerHandle));
+            archive->current->handle = handle;
+            archive->current->stats = stats;
+            archive->current->references = 1;
+        }
+    }
+
+    if (archive->current) archive->current->references++;
+    return archive->current;
+}
+
+#pragma mark - Requests
+
+static bool CAServerRespond(int fd, UInt32 status, const void *payload, UInt64 length)
+{
+    CAServerResponse response = { .status = status, .reserved = 0, .length = length };
+
+    if (!OSXSendFully(fd, &response, sizeof(CAServerResponse))) return false;
+    return !length || OSXSendFully(fd, payload, length);
+}
+
+// Every name, each one terminated, in a single buffer to free
+static String CAServerListNames(CAArchiveHandle *handle, UInt64 *size)
+{
+    Size length = 0;
+
+    CAArchiveHandleIterate(handle, ^bool (CAArchiveEntryInfo *info, MemoryAddress userinfo) {
+        *(Size *)userinfo += info->nameLength + 1;
+        return true;
+    }, &length);
+
+    // Then once more to copy the names, with `length` counting them back up
+    String names = malloc(length ? length : 1);
+    length = 0;
+
+    CAArchiveHandleIterate(handle, ^bool (CAArchiveEntryInfo *info, MemoryAddress userinfo) {
+        memcpy(names + *(Size *)userinfo, info->name, info->nameLength);
+        names[*(Size *)userinfo + info->nameLength] = 0;
+        *(Size *)userinfo += info->nameLength + 1;
+        return true;
+    }, &length);
+
+    *size = length;
+    return names;
+}
+
+// Answers one request. False once the connection is no use any more.
+static bool CAServerServe(CAServer *server, int fd, CAServerRequest *request, Path path, String name, Path output)
+{
+    bool known = request->type == kCARequestList || request->type == kCARequestStat || request->type == kCARequestRead;
+    known = known || (request->type == kCARequestExtract && request->outputLength);
+
+    if (!known)
+    {
+        CAServerRespond(fd, kCAStatusBadRequest, NULL, 0);
+        return false;
+    }
+
+    CAServerArchive *archive = CAServerAcquire(server, path);
+    pthread_mutex_lock(&archive->lock);
+
+    CAServerHandle *opened = CAServerArchiveOpen(archive);
+    CAArchiveHandle *handle = opened ? opened->handle : NULL;
+    CAArchiveEntryInfo info;
+    CAServerEntryStat stat;
+
+    // The answer is settled under the archive's lock but sent without it, so a
+    // client that stops reading holds up nobody else. Data read stays in the
+    // mapping, which `opened` keeps until it's sent.
+    UInt32 status = kCAStatusOK;
+    const void *payload = NULL;
+    String names = NULL;
+    UInt64 length = 0;
+
+    if (!handle) {
+        status = kCAStatusNoArchive;
+    } else if (request->type == kCARequestList) {
+        payload = names = CAServerListNames(handle, &length);
+    } else if (!CAArchiveHandleFind(handle, name, &info)) {
+        status = kCAStatusNoEntry;
+    } else if (request->type == kCARequestStat) {
+        stat = (CAServerEntryStat){ .type = info.type, .reserved = { 0 }, .size = info.size, .index = info.index };
+        payload = &stat;
+        length = sizeof(CAServerEntryStat);
+    } else if (request->type == kCARequestRead) {
+        UInt8 *data = CAArchiveHandleGetData(handle, &info);
+        UInt64 offset = (request->offset < info.size) ? request->offset : info.size;
+
+        if (data) {
+            payload = data + offset;
+            length = (request->length < info.size - offset) ? request->length : (info.size - offset);
+        } else {
+            status = kCAStatusFailed;
+        }
+    } else if (!CAArchiveHandleExtract(handle, &info, output)) {
+        status = kCAStatusFailed;
+    }
+
+    pthread_mutex_unlock(&archive->lock);
+
+    bool sent = CAServerRespond(fd, status, payload, length);
+    free(names);
+
+    if (opened)
+    {
+        pthread_mutex_lock(&archive->lock);
+        CAServerHandleRelease(opened);
+        pthread_mutex_unlock(&archive->lock);
+    }
+
+    CAServerRelease(server, archive);
+    return sent;
+}
+
+static void *CAServerConnectionRun(void *context)
+{
+    CAServerConnection *connection = context;
+    CAServer *server = connection->server;
+    int fd = connection->fd;
+    free(connection);
+
+    CAServerRequest request;
+    char magic[4] = kCAServerMagic;
+
+    while (OSXReceiveFully(fd, &request, sizeof(CAServerRequest)))
+    {
+        bool valid = !memcmp(request.magic, magic, 4) && request.archiveLength;
+        valid = valid && request.archiveLength <= kCAServerStringMax && request.nameLength <= kCAServerStringMax && request.outputLength <= kCAServerStringMax;
+
+        if (!valid)
+        {
+            CAServerRespond(fd, kCAStatusBadRequest, NULL, 0);
+            break;
+        }
+
+        // The three strings, each terminated here
+        String path = malloc(request.archiveLength + request.nameLength + request.outputLength + 3);
+        String name = path + request.archiveLength + 1;
+        String output = name + request.nameLength + 1;
+
+        bool received = OSXReceiveFully(fd, path, request.archiveLength);
+        received = received && OSXReceiveFully(fd, name, request.nameLength);
+        received = received && OSXReceiveFully(fd, output, request.outputLength);
+
+        path[request.archiveLength] = 0;
+        name[request.nameLength] = 0;
+        output[request.outputLength] = 0;
+
+        bool served = received && CAServerServe(server, fd, &request, path, name, output);
+        free(path);
+
+        if (!served) break;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+#pragma mark - Server
+
+CAServer *CAServerCreate(Path socket)
+{
+    int listener = OSXListenOnSocket(socket);
+    if (listener < 0) return NULL;
+
+    CAServer *server = calloc(1, sizeof(CAServer));
+    server->listener = listener;
+    server->socket = strdup(socket);
+    pthread_mutex_init(&server->lock, NULL);
+    return server;
+}
+
+// Opens an archive ahead of its first request
+bool CAServerAddArchive(CAServer *server, Path archive)
+{
+    CAServerArchive *cached = CAServerAcquire(server, archive);
+    pthread_mutex_lock(&cached->lock);
+
+    CAServerHandle *opened = CAServerArchiveOpen(cached);
+    if (opened) CAServerHandleRelease(opened);
+
+    pthread_mutex_unlock(&cached->lock);
+    CAServerRelease(server, cached);
+    return opened != NULL;
+}
+
+// Serves connections, each on its own thread, until accepting one fails
+bool CAServerRun(CAServer *server)
+{
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+    for (;;)
+    {
+        int fd = OSXAcceptOnSocket(server->listener);
+        if (fd < 0) break;
+
+        CAServerConnection *connection = malloc(sizeof(CAServerConnection));
+        connection->server = server;
+        connection->fd = fd;
+
+        pthread_t thread;
+        int error = pthread_create(&thread, &attributes, CAServerConnectionRun, connection);
+
+        if (error)
+        {
+            fprintf(stderr, "Error: Could not start a thread for a new connection: %s\n", strerror(error));
+            free(connection);
+            close(fd);
+        }
+    }
+
+    pthread_attr_destroy(&attributes);
+    fprintf(stderr, "Error: Stopped accepting connections on '%s'\n", server->socket);
+    return false;
+}
+
+void CAServerDestroy(CAServer *server)
+{
+    close(server->listener);
+    unlink(server->socket);
+
+    for (UInt64 i = 0; i < server->archiveCount; i++)
+        CAServerArchiveDestroy(server->archives[i]);
+
+    pthread_mutex_destroy(&server->lock);
+    free(server->archives);
+    free(server->socket);
+    free(server);
+}
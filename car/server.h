@@ -0,0 +1,82 @@
+#ifndef __CAR_SERVER__
+#define __CAR_SERVER__ 1
+
+#include "archive.h"
+
+#define kCAServerMagic       {'C', 'A', 'R', 'Q'}
+#define kCAServerArchivesMax 64
+#define kCAServerStringMax   (1 << 16)
+
+#define kCARequestList       'L'
+#define kCARequestStat       'S'
+#define kCARequestRead       'R'
+#define kCARequestExtract    'X'
+
+#define kCAStatusOK          0
+#define kCAStatusBadRequest  1
+#define kCAStatusNoArchive   2
+#define kCAStatusNoEntry     3
+#define kCAStatusFailed      4
+#define kCAStatusLost        5  // Never sent, a client's own once the connection fails
+
+// Serves archives to local clients over a Unix domain socket. Archives are
+// opened on first use and kept open with their tables indexed, so a lookup
+// costs a search of the table and no more. kCAServerArchivesMax is a soft
+// limit: opening one more closes the least recently used archives, but only
+// those no request is using, so with more archives in use at once the cache
+// holds all of them (and shrinks back as later ones are opened).
+//
+// An archive is reopened once the file at its path is a different one (by
+// device, inode, size or modification time), so archives are replaced by
+// renaming a new file over the old. Never rewrite or truncate a served
+// archive in place: the server reads it through a mapping, and a request in
+// flight would fault (SIGBUS) and take the whole server down.
+//
+// Each request is a CAServerRequest followed by `archiveLength` bytes of
+// archive path, `nameLength` bytes of entry name and `outputLength` bytes of
+// output path (for kCARequestExtract), none of them terminated. Each answer
+// is a CAServerResponse followed by `length` bytes of payload:
+//
+//   kCARequestList     every entry name, each one terminated by a 0
+//   kCARequestStat     a CAServerEntryStat
+//   kCARequestRead     up to `length` bytes of the entry's data as stored,
+//                      from `offset` on
+//   kCARequestExtract  nothing, the server writes the entry to the output
+//
+// Both ends are on one machine, so everything is in host order. Requests on
+// one connection are answered in turn; a malformed one ends the connection.
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    UInt8 type;
+    UInt8 reserved[3];
+    UInt32 archiveLength;
+    UInt32 nameLength;
+    UInt32 outputLength;
+    UInt32 reserved2;
+    UInt64 offset;
+    UInt64 length;
+} CAServerRequest;
+
+typedef struct __attribute__((packed)) {
+    UInt32 status;          // One of the kCAStatus codes
+    UInt32 reserved;
+    UInt64 length;
+} CAServerResponse;
+
+typedef struct __attribute__((packed)) {
+    UInt8 type;
+    UInt8 reserved[7];
+    UInt64 size;            // Of the data as stored
+    UInt64 index;
+} CAServerEntryStat;
+
+typedef struct CAServer CAServer;
+
+extern CAServer *CAServerCreate(Path socket);
+extern bool CAServerAddArchive(CAServer *server, Path archive);
+extern bool CAServerRun(CAServer *server);
+extern void CAServerDestroy(CAServer *server);
+
+// CAServerCreate --> Call CAServerDestroy (once CAServerRun has returned)
+
+#endif /* !defined(__CAR_SERVER__) */
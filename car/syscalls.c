@@ -1,5 +1,11 @@
 #include "syscalls.h"
 
+#if defined(__linux__)
+    #include <sys/ioctl.h>
+    #include <linux/fs.h>
+    #include <linux/fiemap.h>
+#endif
+
 bool OSXRunBlockOnDirectoryContents(Path path, bool (^block)(Path, DirectoryEntry, MemoryAddress), MemoryAddress userinfo)
 {
     Directory directory = opendir(path);
@@ -93,6 +99,236 @@ UInt32 OSXCalculateChecksum(UInt8 *data, Size size)
     return (checksum ^ 0xFFFFFFFF);
 }
 
+#include "crc32c_table.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #include <nmmintrin.h>
+
+    #define OSX_HAVE_CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    #include <arm_acle.h>
+
+    #define OSX_HAVE_CRC32C_ARM 1
+#endif
+
+static UInt32 OSXCalculateCRC32CTable(UInt32 checksum, UInt8 *data, Size size)
+{
+    for (Size i = 0; i < size; i++)
+        checksum = (checksum >> 8) ^ crc32c_table[(checksum & 0xFF) ^ *data++];
+
+    return checksum;
+}
+
+#if defined(OSX_HAVE_CRC32C_X86)
+
+__attribute__((target("sse4.2"))) static UInt32 OSXCalculateCRC32CHardware(UInt32 checksum, UInt8 *data, Size size)
+{
+    UInt64 wide = checksum;
+
+    for (; size >= sizeof(UInt64); size -= sizeof(UInt64), data += sizeof(UInt64))
+    {
+        UInt64 word;
+        memcpy(&word, data, sizeof(UInt64));
+        wide = _mm_crc32_u64(wide, word);
+    }
+
+    checksum = (UInt32)wide;
+
+    while (size--)
+        checksum = _mm_crc32_u8(checksum, *data++);
+
+    return checksum;
+}
+
+static bool OSXHaveCRC32CHardware(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(OSX_HAVE_CRC32C_ARM)
+
+static UInt32 OSXCalculateCRC32CHardware(UInt32 checksum, UInt8 *data, Size size)
+{
+    for (; size >= sizeof(UInt64); size -= sizeof(UInt64), data += sizeof(UInt64))
+    {
+        UInt64 word;
+        memcpy(&word, data, sizeof(UInt64));
+        checksum = __crc32cd(checksum, word);
+    }
+
+    while (size--)
+        checksum = __crc32cb(checksum, *data++);
+
+    return checksum;
+}
+
+static bool OSXHaveCRC32CHardware(void)
+{
+    return true;
+}
+
+#endif
+
+// CRC32C (Castagnoli), with the CPU's instruction when it has one
+UInt32 OSXCalculateCRC32C(UInt8 *data, Size size)
+{
+#if defined(OSX_HAVE_CRC32C_X86) || defined(OSX_HAVE_CRC32C_ARM)
+    if (OSXHaveCRC32CHardware())
+        return OSXCalculateCRC32CHardware(0xFFFFFFFF, data, size) ^ 0xFFFFFFFF;
+#endif
+
+    return OSXCalculateCRC32CTable(0xFFFFFFFF, data, size) ^ 0xFFFFFFFF;
+}
+
+#define kOSXPolynomialCRC32  0xEDB88320
+#define kOSXPolynomialCRC32C 0x82F63B78
+
+// Multiplies two polynomials modulo a CRC polynomial, all bit-reflected
+static UInt32 OSXMultiplyModulo(UInt32 a, UInt32 b, UInt32 polynomial)
+{
+    UInt32 product = 0;
+
+    for (UInt32 bit = 1U << 31; bit; bit >>= 1)
+    {
+        if (a & bit) product ^= b;
+        b = (b & 1) ? ((b >> 1) ^ polynomial) : (b >> 1);
+    }
+
+    return product;
+}
+
+// Feeds `size` zero bytes through a raw CRC register, in log(size) steps
+static UInt32 OSXShiftCRC(UInt32 checksum, UInt64 size, UInt32 polynomial)
+{
+    UInt32 power = 1U << 23;    // x^8, one byte
+    UInt32 factor = 1U << 31;   // x^0
+
+    for (; size; size >>= 1)
+    {
+        if (size & 1) factor = OSXMultiplyModulo(power, factor, polynomial);
+        power = OSXMultiplyModulo(power, power, polynomial);
+    }
+
+    return OSXMultiplyModulo(factor, checksum, polynomial);
+}
+
+// The CRC32 of A followed by B, from the CRC32s of A and B and the size of
+// B. Given the CRC32 of A followed by B as `second`, this gives the CRC32 of
+// B alone instead.
+UInt32 OSXCombineChecksums(UInt32 first, UInt32 second, UInt64 secondSize)
+{
+    return OSXShiftCRC(first, secondSize, kOSXPolynomialCRC32) ^ second;
+}
+
+// As OSXCombineChecksums, for CRC32C
+UInt32 OSXCombineCRC32C(UInt32 first, UInt32 second, UInt64 secondSize)
+{
+    return OSXShiftCRC(first, secondSize, kOSXPolynomialCRC32C) ^ second;
+}
+
+#define kOSXPrime64_1 0x9E3779B185EBCA87ULL
+#define kOSXPrime64_2 0xC2B2AE3D27D4EB4FULL
+#define kOSXPrime64_3 0x165667B19E3779F9ULL
+#define kOSXPrime64_4 0x85EBCA77C2B2AE63ULL
+#define kOSXPrime64_5 0x27D4EB2F165667C5ULL
+
+#define OSXRotateLeft64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static UInt64 OSXReadLittle64(UInt8 *data)
+{
+    UInt64 value;
+    memcpy(&value, data, sizeof(UInt64));
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    value = __builtin_bswap64(value);
+#endif
+
+    return value;
+}
+
+static UInt32 OSXReadLittle32(UInt8 *data)
+{
+    UInt32 value;
+    memcpy(&value, data, sizeof(UInt32));
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    value = __builtin_bswap32(value);
+#endif
+
+    return value;
+}
+
+static UInt64 OSXXXH64Round(UInt64 accumulator, UInt64 input)
+{
+    accumulator += input * kOSXPrime64_2;
+    accumulator = OSXRotateLeft64(accumulator, 31);
+    return accumulator * kOSXPrime64_1;
+}
+
+static UInt64 OSXXXH64Merge(UInt64 accumulator, UInt64 value)
+{
+    accumulator ^= OSXXXH64Round(0, value);
+    return (accumulator * kOSXPrime64_1) + kOSXPrime64_4;
+}
+
+// XXH64 with a seed of 0. Four independent lanes keep the multipliers busy.
+UInt64 OSXCalculateXXH64(UInt8 *data, Size size)
+{
+    UInt8 *end = data + size;
+    UInt64 hash;
+
+    if (size >= 32) {
+        UInt64 v1 = kOSXPrime64_1 + kOSXPrime64_2;
+        UInt64 v2 = kOSXPrime64_2;
+        UInt64 v3 = 0;
+        UInt64 v4 = -kOSXPrime64_1;
+
+        for (; end - data >= 32; data += 32)
+        {
+            v1 = OSXXXH64Round(v1, OSXReadLittle64(data +  0));
+            v2 = OSXXXH64Round(v2, OSXReadLittle64(data +  8));
+            v3 = OSXXXH64Round(v3, OSXReadLittle64(data + 16));
+            v4 = OSXXXH64Round(v4, OSXReadLittle64(data + 24));
+        }
+
+        hash = OSXRotateLeft64(v1, 1) + OSXRotateLeft64(v2, 7) + OSXRotateLeft64(v3, 12) + OSXRotateLeft64(v4, 18);
+        hash = OSXXXH64Merge(hash, v1);
+        hash = OSXXXH64Merge(hash, v2);
+        hash = OSXXXH64Merge(hash, v3);
+        hash = OSXXXH64Merge(hash, v4);
+    } else {
+        hash = kOSXPrime64_5;
+    }
+
+    hash += size;
+
+    for (; end - data >= 8; data += 8)
+    {
+        hash ^= OSXXXH64Round(0, OSXReadLittle64(data));
+        hash = (OSXRotateLeft64(hash, 27) * kOSXPrime64_1) + kOSXPrime64_4;
+    }
+
+    if (end - data >= 4)
+    {
+        hash ^= (UInt64)OSXReadLittle32(data) * kOSXPrime64_1;
+        hash = (OSXRotateLeft64(hash, 23) * kOSXPrime64_2) + kOSXPrime64_3;
+        data += 4;
+    }
+
+    for (; data < end; data++)
+    {
+        hash ^= *data * kOSXPrime64_5;
+        hash = OSXRotateLeft64(hash, 11) * kOSXPrime64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kOSXPrime64_2;
+    hash ^= hash >> 29;
+    hash *= kOSXPrime64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
 bool OSXWriteFileTo(Path file, MemoryAddress destination)
 {
     FileStats *stats = OSXReadFileStats(file, true);
@@ -139,6 +375,166 @@ bool OSXWriteFileTo(Path file, MemoryAddress destination)
     return true;
 }
 
+// Extents are (offset, length) pairs. Without SEEK_DATA/SEEK_HOLE support the whole file is one extent.
+bool OSXReadFileExtents(Path path, Size size, UInt64 **extents, UInt64 *count)
+{
+    UInt64 capacity = 4, found = 0;
+    UInt64 *result = malloc(capacity * 2 * sizeof(UInt64));
+    bool dense = true;
+
+    #if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "Error: Could not open file at '%s'\n", path);
+            perror("open");
+            free(result);
+            return false;
+        }
+
+        Offset offset = 0;
+        dense = false;
+
+        while (offset < (Offset)size)
+        {
+            Offset data = lseek(fd, offset, SEEK_DATA);
+
+            // ENXIO means there is only a hole left
+            if (data < 0 && errno == ENXIO) break;
+            Offset hole = (data < 0) ? -1 : lseek(fd, data, SEEK_HOLE);
+
+            if (hole < 0)
+            {
+                dense = true;
+                break;
+            }
+
+            if (hole > (Offset)size) hole = size;
+
+            if (found == capacity)
+            {
+                capacity *= 2;
+                result = realloc(result, capacity * 2 * sizeof(UInt64));
+            }
+
+            result[(2 * found) + 0] = data;
+            result[(2 * found) + 1] = hole - data;
+            found++;
+
+            offset = hole;
+        }
+
+        if (close(fd))
+        {
+            fprintf(stderr, "Error: Could not close file at '%s'\n", path);
+            perror("close");
+        }
+    #endif /* defined(SEEK_DATA) && defined(SEEK_HOLE) */
+
+    if (dense)
+    {
+        result[0] = 0;
+        result[1] = size;
+        found = 1;
+    }
+
+    *extents = result;
+    *count = found;
+    return true;
+}
+
+// Where on its device a file's data starts, if the filesystem will say.
+// Files without a fixed place (empty, inline or not yet allocated) have none.
+bool OSXReadFileLocation(Path path, UInt64 *location)
+{
+    bool found = false;
+
+    #if defined(F_LOG2PHYS_EXT) || defined(FS_IOC_FIEMAP)
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        #if defined(F_LOG2PHYS_EXT)
+            struct log2phys physical = { .l2p_contigbytes = 1, .l2p_devoffset = 0 };
+
+            if (!fcntl(fd, F_LOG2PHYS_EXT, &physical))
+            {
+                *location = physical.l2p_devoffset;
+                found = true;
+            }
+        #else
+            struct {
+                struct fiemap map;
+                struct fiemap_extent extent;
+            } request;
+
+            memset(&request, 0, sizeof(request));
+            request.map.fm_length = FIEMAP_MAX_OFFSET;
+            request.map.fm_extent_count = 1;
+
+            UInt32 unplaced = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE;
+
+            if (!ioctl(fd, FS_IOC_FIEMAP, &request.map) && request.map.fm_mapped_extents && !(request.extent.fe_flags & unplaced))
+            {
+                *location = request.extent.fe_physical;
+                found = true;
+            }
+        #endif
+
+        close(fd);
+    #endif
+
+    return found;
+}
+
+bool OSXWriteExtentsTo(Path file, UInt64 *extents, UInt64 count, MemoryAddress destination)
+{
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open file at '%s'\n", file);
+        perror("open");
+        return false;
+    }
+
+    bool success = true;
+
+    for (UInt64 i = 0; i < count && success; i++)
+    {
+        UInt64 offset = extents[(2 * i) + 0];
+        UInt64 length = extents[(2 * i) + 1];
+
+        while (length)
+        {
+            SSize done = pread(fd, destination, length, offset);
+
+            if (done <= 0)
+            {
+                if (done < 0 && errno == EINTR) continue;
+
+                fprintf(stderr, "Error: Could not read extent at %llu of file at '%s'\n", (unsigned long long)offset, file);
+                perror("pread");
+                success = false;
+                break;
+            }
+
+            destination += done;
+            offset += done;
+            length -= done;
+        }
+    }
+
+    if (close(fd))
+    {
+        fprintf(stderr, "Error: Could not close file at '%s'\n", file);
+        perror("close");
+        return false;
+    }
+
+    return success;
+}
+
 bool OSXUnmapFile(MemoryAddress mapaddr, Size size)
 {
     if (munmap(mapaddr, size))
@@ -251,6 +647,24 @@ bool OSXCreateDirectoryAt(Path path)
     return true;
 }
 
+bool OSXCreateDirectoriesAt(Path path)
+{
+    if (OSXFileExists(path)) return true;
+
+    String partial = strdup(path);
+    bool success = true;
+
+    for (String slash = strchr(partial + 1, '/'); slash && success; slash = strchr(slash + 1, '/'))
+    {
+        *slash = 0;
+        success = OSXCreateDirectoryAt(partial);
+        *slash = '/';
+    }
+
+    free(partial);
+    return success && OSXCreateDirectoryAt(path);
+}
+
 bool OSXUnlinkItemAt(Path path)
 {
     if (!OSXFileExists(path)) return true;
@@ -295,7 +709,7 @@ bool OSXWriteDataToFile(MemoryAddress data, Size size, Path path)
         return false;
     }
 
-    SSize written = fwrite(data, size, 1, fp);
+    SSize written = size ? fwrite(data, size, 1, fp) : 1;
 
     if (written != 1)
     {
@@ -339,3 +753,501 @@ bool OSXFileExists(Path path)
 {
     return (access(path, F_OK) ? false : true);
 }
+
+// Asks the kernel to start reading a range of a file in the background
+void OSXAdviseWillNeed(int fd, Offset offset, Size length)
+{
+#if defined(F_RDADVISE)
+    // The count is an int, so large ranges go out in pieces
+    while (length)
+    {
+        int count = (length > INT32_MAX) ? INT32_MAX : (int)length;
+        struct radvisory advice = { .ra_offset = offset, .ra_count = count };
+
+        if (fcntl(fd, F_RDADVISE, &advice)) return;
+
+        offset += count;
+        length -= count;
+    }
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+// Drops a consumed range of a mapped file. The pages have to leave the
+// mapping before the page cache will let go of them.
+void OSXAdviseDontNeed(int fd, MemoryAddress mapping, Offset offset, Size length)
+{
+    madvise(mapping + offset, length, MADV_DONTNEED);
+
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#define kOSXCopyBufferSize (1 << 20)
+
+// Copies a range between two open files inside the kernel where it can
+// (filesystems with reflinks may even share the blocks), and through a
+// buffer where it can't.
+bool OSXCopyFileRange(int from, Offset fromOffset, int to, Offset toOffset, Size length)
+{
+#if defined(SYS_copy_file_range)
+    while (length)
+    {
+        SInt64 input = fromOffset, output = toOffset;
+        SSize copied = syscall(SYS_copy_file_range, from, &input, to, &output, length, 0);
+
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) break;
+
+        fromOffset += copied;
+        toOffset += copied;
+        length -= copied;
+    }
+#endif
+
+    UInt8 *buffer = length ? malloc(kOSXCopyBufferSize) : NULL;
+
+    while (length)
+    {
+        SSize count = pread(from, buffer, (length > kOSXCopyBufferSize) ? kOSXCopyBufferSize : length, fromOffset);
+
+        if (count < 0 && errno == EINTR) continue;
+
+        if (count <= 0)
+        {
+            fprintf(stderr, "Error: Could not read %zu bytes from descriptor %d\n", length, from);
+            if (count < 0) perror("pread");
+            free(buffer);
+            return false;
+        }
+
+        for (SSize written = 0; written < count;)
+        {
+            SSize result = pwrite(to, buffer + written, count - written, toOffset + written);
+
+            if (result < 0 && errno == EINTR) continue;
+
+            if (result < 0)
+            {
+                fprintf(stderr, "Error: Could not write %zd bytes to descriptor %d\n", count - written, to);
+                perror("pwrite");
+                free(buffer);
+                return false;
+            }
+
+            written += result;
+        }
+
+        fromOffset += count;
+        toOffset += count;
+        length -= count;
+    }
+
+    free(buffer);
+    return true;
+}
+
+#include <dispatch/dispatch.h>
+
+void OSXApplyConcurrently(Size iterations, MemoryAddress context, void (*work)(MemoryAddress, Size))
+{
+    dispatch_apply_f(iterations, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), context, work);
+}
+
+#pragma mark - Output Buffer
+
+OSXOutputBuffer *OSXOutputBufferCreate(int fd)
+{
+    OSXOutputBuffer *buffer = malloc(sizeof(OSXOutputBuffer));
+    buffer->fd = fd;
+    buffer->used = 0;
+    return buffer;
+}
+
+static bool OSXWriteFully(int fd, const UInt8 *data, Size size)
+{
+    while (size)
+    {
+        SSize written = write(fd, data, size);
+
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+
+            fprintf(stderr, "Error: Could not write %zu bytes to descriptor %d\n", size, fd);
+            perror("write");
+            return false;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool OSXOutputBufferAppend(OSXOutputBuffer *buffer, const void *data, Size size)
+{
+    if (buffer->used + size > kOSXOutputBufferSize)
+    {
+        if (!OSXOutputBufferFlush(buffer)) return false;
+
+        // Anything which won't fit in an empty buffer goes straight out
+        if (size > kOSXOutputBufferSize) return OSXWriteFully(buffer->fd, data, size);
+    }
+
+    memcpy(buffer->data + buffer->used, data, size);
+    buffer->used += size;
+    return true;
+}
+
+bool OSXOutputBufferFlush(OSXOutputBuffer *buffer)
+{
+    bool success = OSXWriteFully(buffer->fd, (UInt8 *)buffer->data, buffer->used);
+    buffer->used = 0;
+    return success;
+}
+
+bool OSXOutputBufferDestroy(OSXOutputBuffer *buffer)
+{
+    bool success = OSXOutputBufferFlush(buffer);
+    free(buffer);
+    return success;
+}
+
+#pragma mark - Directory Handles
+
+// Every name here is a single path component looked up in an open
+// directory. Nothing is followed through a symlink at the last component,
+// so an existing link can't redirect where extracted data ends up.
+
+int OSXOpenDirectoryIn(int directory, String name)
+{
+    int fd = openat(directory, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open directory '%s'\n", name);
+        perror("openat");
+    }
+
+    return fd;
+}
+
+bool OSXCreateDirectoryIn(int directory, String name)
+{
+    if (mkdirat(directory, name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) && errno != EEXIST)
+    {
+        fprintf(stderr, "Error: Could not create directory '%s'\n", name);
+        perror("mkdirat");
+        return false;
+    }
+
+    return true;
+}
+
+static int OSXCreateFileIn(int directory, String name)
+{
+    int fd = openat(directory, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not open file '%s'\n", name);
+        perror("openat");
+    }
+
+    return fd;
+}
+
+static bool OSXCloseFileIn(int fd, String name)
+{
+    if (close(fd))
+    {
+        fprintf(stderr, "Error: Could not close file '%s'\n", name);
+        perror("close");
+        return false;
+    }
+
+    return true;
+}
+
+bool OSXWriteDataToFileIn(int directory, String name, MemoryAddress data, Size size)
+{
+    int fd = OSXCreateFileIn(directory, name);
+    if (fd < 0) return false;
+
+    bool success = OSXWriteFully(fd, data, size);
+    if (!success) fprintf(stderr, "Error: Could not write data to file '%s'\n", name);
+
+    return OSXCloseFileIn(fd, name) && success;
+}
+
+// Only the extents are written; everything else is left as holes
+bool OSXWriteSparseDataToFileIn(int directory, String name, MemoryAddress data, UInt64 *extents, UInt64 count, Size size)
+{
+    int fd = OSXCreateFileIn(directory, name);
+    if (fd < 0) return false;
+
+    bool success = true;
+
+    if (ftruncate(fd, size))
+    {
+        fprintf(stderr, "Error: Could not extend file '%s' to be '%zu' bytes\n", name, size);
+        perror("ftruncate");
+        success = false;
+    }
+
+    for (UInt64 i = 0; i < count && success; i++)
+    {
+        UInt64 offset = extents[(2 * i) + 0];
+        UInt64 length = extents[(2 * i) + 1];
+
+        while (length)
+        {
+            SSize done = pwrite(fd, data, length, offset);
+
+            if (done < 0)
+            {
+                if (errno == EINTR) continue;
+
+                fprintf(stderr, "Error: Could not write extent at %llu of file '%s'\n", (unsigned long long)offset, name);
+                perror("pwrite");
+                success = false;
+                break;
+            }
+
+            data += done;
+            offset += done;
+            length -= done;
+        }
+    }
+
+    return OSXCloseFileIn(fd, name) && success;
+}
+
+// An existing entry is left alone, as with the path based extraction
+bool OSXCreateSymlinkIn(int directory, String from, String name)
+{
+    if (!symlinkat(from, directory, name)) return true;
+
+    if (errno == EEXIST)
+    {
+        fprintf(stderr, "Warning: file '%s' already exists. Will ignore\n", name);
+        return true;
+    }
+
+    fprintf(stderr, "Error: Could not create a symlink from '%s' to '%s'\n", from, name);
+    perror("symlinkat");
+    return false;
+}
+
+#pragma mark - Sockets
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#if defined(MSG_NOSIGNAL)
+    #define kOSXSendFlags MSG_NOSIGNAL
+#else
+    #define kOSXSendFlags 0
+#endif
+
+// Writes to a closed peer fail with EPIPE instead of raising SIGPIPE
+static void OSXIgnoreBrokenPipe(int fd)
+{
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+static bool OSXSocketAddress(Path path, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", path);
+        return false;
+    }
+
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// A socket at `path` nobody is listening on any more. Whether anybody is
+// can only be told by connecting to it.
+static bool OSXSocketIsStale(Path path, struct sockaddr_un *address)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not create socket for '%s'\n", path);
+        perror("socket");
+        return false;
+    }
+
+    bool connected = !connect(fd, (struct sockaddr *)address, sizeof(struct sockaddr_un));
+    int error = errno;
+    close(fd);
+
+    if (!connected && error == ECONNREFUSED) return true;
+
+    if (connected) {
+        fprintf(stderr, "Error: Socket at '%s' is already in use\n", path);
+    } else {
+        fprintf(stderr, "Error: Could not tell whether socket at '%s' is in use\n", path);
+        errno = error;
+        perror("connect");
+    }
+
+    return false;
+}
+
+// Listens on a Unix domain socket only the owner can connect to. A socket
+// left behind at `path` is replaced, one still listened on or anything else
+// there is an error.
+int OSXListenOnSocket(Path path)
+{
+    struct sockaddr_un address;
+    if (!OSXSocketAddress(path, &address)) return -1;
+
+    FileStats stats;
+
+    if (!lstat(path, &stats) && S_ISSOCK(stats.st_mode))
+    {
+        if (!OSXSocketIsStale(path, &address)) return -1;
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not create socket for '%s'\n", path);
+        perror("socket");
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Nobody can connect before listen, so the mode is narrowed in between
+    // (rather than through umask, which the whole process shares)
+    String failed = NULL;
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address))) failed = "bind";
+    else if (chmod(path, S_IRWXU)) failed = "chmod";
+    else if (listen(fd, SOMAXCONN)) failed = "listen";
+
+    if (failed)
+    {
+        fprintf(stderr, "Error: Could not listen on socket at '%s'\n", path);
+        perror(failed);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Waits for the next connection, -1 if accept fails for any reason but a signal
+int OSXAcceptOnSocket(int listener)
+{
+    for (;;)
+    {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd >= 0)
+        {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            OSXIgnoreBrokenPipe(fd);
+            return fd;
+        }
+
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+
+        perror("accept");
+        return -1;
+    }
+}
+
+int OSXConnectToSocket(Path path)
+{
+    struct sockaddr_un address;
+    if (!OSXSocketAddress(path, &address)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Could not create socket for '%s'\n", path);
+        perror("socket");
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    OSXIgnoreBrokenPipe(fd);
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)))
+    {
+        fprintf(stderr, "Error: Could not connect to socket at '%s'\n", path);
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool OSXSendFully(int fd, const void *data, Size size)
+{
+    const UInt8 *bytes = data;
+
+    while (size)
+    {
+        SSize sent = send(fd, bytes, size, kOSXSendFlags);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+
+            perror("send");
+            return false;
+        }
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+// Also false when the peer closes the connection first, which isn't reported
+bool OSXReceiveFully(int fd, void *data, Size size)
+{
+    UInt8 *bytes = data;
+
+    while (size)
+    {
+        SSize received = recv(fd, bytes, size, 0);
+
+        if (received < 0)
+        {
+            if (errno == EINTR) continue;
+
+            perror("recv");
+            return false;
+        }
+
+        if (!received) return false;
+
+        bytes += received;
+        size -= received;
+    }
+
+    return true;
+}
@@ -3,12 +3,21 @@
 
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#if defined(__linux__)
+    #include <sys/syscall.h>
+#endif
 #include <stdbool.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 
 #define OSXIsDirectory(fs) S_ISDIR(fs->st_mode)
@@ -39,24 +48,63 @@ typedef String Path;
     typedef size_t Size;
 #endif
 
+#define kOSXOutputBufferSize (1 << 16)
+
+typedef struct {
+    int fd;
+    Size used;
+    char data[kOSXOutputBufferSize];
+} OSXOutputBuffer;
+
 extern bool OSXRunBlockOnDirectoryContents(Path directory, bool (^block)(Path, DirectoryEntry, MemoryAddress), MemoryAddress userinfo);
 extern MemoryAddress OSXMapFile(Path path, Size size, Offset startOffset, bool write);
 extern bool OSXWriteDataToFile(MemoryAddress data, Size size, Path path);
 extern MemoryAddress OSXMapFileFully(Path path, Size *size, bool write);
 extern bool OSXWriteFileTo(Path file, MemoryAddress destination);
+extern bool OSXReadFileExtents(Path path, Size size, UInt64 **extents, UInt64 *count);
+extern bool OSXReadFileLocation(Path path, UInt64 *location);
+extern bool OSXWriteExtentsTo(Path file, UInt64 *extents, UInt64 count, MemoryAddress destination);
 extern FileStats *OSXReadFileStats(Path path, bool followLinks);
 extern bool OSXUnmapFile(MemoryAddress mapaddr, Size size);
 extern UInt32 OSXCalculateChecksum(UInt8 *data, Size size);
+extern UInt32 OSXCalculateCRC32C(UInt8 *data, Size size);
+extern UInt64 OSXCalculateXXH64(UInt8 *data, Size size);
+extern UInt32 OSXCombineChecksums(UInt32 first, UInt32 second, UInt64 secondSize);
+extern UInt32 OSXCombineCRC32C(UInt32 first, UInt32 second, UInt64 secondSize);
 extern bool OSXZeroFileToSize(Path path, Size size);
 extern bool OSXCreateSymlink(Path from, Path to);
 extern String OSXReadLink(Path path, Size *size);
 extern bool OSXHaveSearchAccess(Path directory);
 extern bool OSXCreateDirectoryAt(Path path);
+extern bool OSXCreateDirectoriesAt(Path path);
 extern bool OSXUnlinkItemAt(Path path);
 extern bool OSXCanReadFile(Path file);
 extern bool OSXCreateFile(Path path);
 extern bool OSXFileExists(Path path);
 
+extern void OSXAdviseWillNeed(int fd, Offset offset, Size length);
+extern void OSXAdviseDontNeed(int fd, MemoryAddress mapping, Offset offset, Size length);
+extern bool OSXCopyFileRange(int from, Offset fromOffset, int to, Offset toOffset, Size length);
+
+extern int OSXOpenDirectoryIn(int directory, String name);
+extern bool OSXCreateDirectoryIn(int directory, String name);
+extern bool OSXWriteDataToFileIn(int directory, String name, MemoryAddress data, Size size);
+extern bool OSXWriteSparseDataToFileIn(int directory, String name, MemoryAddress data, UInt64 *extents, UInt64 count, Size size);
+extern bool OSXCreateSymlinkIn(int directory, String from, String name);
+
+extern void OSXApplyConcurrently(Size iterations, MemoryAddress context, void (*work)(MemoryAddress, Size));
+
+extern int OSXListenOnSocket(Path path);
+extern int OSXAcceptOnSocket(int listener);
+extern int OSXConnectToSocket(Path path);
+extern bool OSXSendFully(int fd, const void *data, Size size);
+extern bool OSXReceiveFully(int fd, void *data, Size size);
+
+extern OSXOutputBuffer *OSXOutputBufferCreate(int fd);
+extern bool OSXOutputBufferAppend(OSXOutputBuffer *buffer, const void *data, Size size);
+extern bool OSXOutputBufferFlush(OSXOutputBuffer *buffer);
+extern bool OSXOutputBufferDestroy(OSXOutputBuffer *buffer);
+
 // OSXMapFile          --> Call OSXUnmapFile
 // OSXMapFileFully     --> Call OSXUnmapFile
 // OSXReadFileStats    --> Call free
@@ -65,7 +113,13 @@ extern bool OSXFileExists(Path path);
 // OSXCanReadFile      --> N/A
 // OSXCreateFile       --> N/A
 // OSXReadLink         --> Call free
+// OSXReadFileExtents  --> Call free (on *extents)
 // OSXFileExists       --> N/A
 // OSXZeroFileToSize   --> N/A
+// OSXOutputBufferCreate --> Call OSXOutputBufferDestroy
+// OSXOpenDirectoryIn  --> Call close
+// OSXListenOnSocket   --> Call close
+// OSXAcceptOnSocket   --> Call close
+// OSXConnectToSocket  --> Call close
 
 #endif /* !defined(__car__syscalls__) */